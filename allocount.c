@@ -0,0 +1,74 @@
+#define _GNU_SOURCE // RTLD_NEXT
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include "allocount.h"
+
+// dlsym may itself call calloc while the C library's functions are being
+// looked up, that is served from a static buffer
+static void *(*libc_malloc)(size_t);
+static void *(*libc_calloc)(size_t, size_t);
+static void *(*libc_realloc)(void *, size_t);
+static void (*libc_free)(void *);
+static long nallocs; // calls to malloc, calloc and realloc
+
+static char boot[4096];
+static size_t boot_used;
+
+static void resolve_allocator(void)
+{
+    static int resolving;
+    if (!libc_malloc && !resolving) {
+        resolving = 1;
+        libc_calloc = dlsym(RTLD_NEXT, "calloc");
+        libc_realloc = dlsym(RTLD_NEXT, "realloc");
+        libc_free = dlsym(RTLD_NEXT, "free");
+        libc_malloc = dlsym(RTLD_NEXT, "malloc");
+        resolving = 0;
+    }
+}
+
+static void *boot_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > sizeof boot) {
+        abort();
+    }
+    boot_used += size;
+    return boot + boot_used - size; // still zero
+}
+
+void *malloc(size_t size)
+{
+    resolve_allocator();
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return libc_malloc ? libc_malloc(size) : boot_alloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    resolve_allocator();
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return libc_calloc ? libc_calloc(n, size) : boot_alloc(n * size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    resolve_allocator();
+    __atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+    return libc_realloc(p, size);
+}
+
+void free(void *p)
+{
+    if ((char *)p >= boot && (char *)p < boot + sizeof boot) {
+        return;
+    }
+    resolve_allocator();
+    libc_free(p);
+}
+
+long alloc_count(void)
+{
+    return __atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+}
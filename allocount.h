@@ -0,0 +1,10 @@
+#ifndef _ALLOCOUNT_H
+#define _ALLOCOUNT_H
+
+// counting allocator: linked into a program, it takes over malloc, calloc,
+// realloc and free and passes them on to the C library's. Needs -ldl.
+
+// calls to malloc, calloc and realloc so far, all threads
+long alloc_count(void);
+
+#endif
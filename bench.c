@@ -0,0 +1,818 @@
+// benchmarks for the thompson_nfa engine
+//
+// usage: nfabench [name]
+//   dstate   cost of a DFA cache miss as the DFA grows
+//   fulldfa  size of RE_FULL_DFA tables and scan speed against the lazy DFA
+//   prefilter  scan speed with and without the start-of-match prefilter
+//   set      one RESet scan against a RE_match per pattern
+//   literals Aho-Corasick against the NFA and DFA on literal alternations
+//   bitnfa   the bit-parallel NFA against the DFA and NFA on `a?^n a^n`
+//   compile  RE_compile + RE_free latency
+//   threads  1-64 threads on one RE, private DFA per context vs RE_SHARED_DFA
+//   allocs   heap allocations per warm RE_match, by engine, exits 1 on any
+//   cache    RECache_get against RE_compile on a stream of repeated patterns
+//   budget   lazy DFA byte budgets on a text with hot and cold states
+//   thrash   a bounded DFA that can't hold its states against the NFA
+//   perf     hardware counters per RE_match call, by engine
+//   jit      the lazy DFA against RE_JIT code
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nfa.h"
+#include "perfcount.h"
+#include "allocount.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_match(RE *re, const char *s)
+{
+    double t = now();
+    if (RE_match(re, s)) {
+        fprintf(stderr, "unexpected match\n");
+        exit(1);
+    }
+    return now() - t;
+}
+
+// `a(a|b)...(a|b)c` with k-1 groups over a random a/b text never matches,
+// and its DFA has one state per mask of where `a` occurred in the last k
+// bytes, so the number of DStates a text creates can be counted exactly.
+// The first scan builds the DFA, the second one only walks it; their
+// difference divided by the states created is the cost of a miss.
+static void bench_dstate(void)
+{
+    printf("%6s %10s %12s %12s %12s\n", "k", "states", "build(ms)", "walk(ms)", "ns/miss");
+    for (int k = 4; k <= 13; ++k) {
+        char rep[4 * 16 + 3];
+        char *p = rep;
+        *p++ = 'a';
+        for (int i = 1; i < k; ++i) {
+            p += sprintf(p, "(a|b)");
+        }
+        strcpy(p, "c");
+
+        size_t len = (size_t)64 << k;
+        char *text = malloc(len + 1);
+        unsigned char *seen = calloc(1, (1 << k) / 8 + 1);
+        unsigned mask = 0;
+        int states = 1;
+        seen[0] = 1;
+        srand(k);
+        for (size_t i = 0; i < len; ++i) {
+            int isa = rand() & 1;
+            text[i] = isa ? 'a' : 'b';
+            mask = ((mask << 1) | isa) & ((1u << k) - 1);
+            if (!(seen[mask / 8] & (1 << mask % 8))) {
+                seen[mask / 8] |= 1 << mask % 8;
+                states++;
+            }
+        }
+        text[len] = 0;
+
+        RE *re = RE_compile(rep);
+        RE_setoption(re, RE_DFA);
+        double build = time_match(re, text);
+        double walk = time_match(re, text);
+        printf("%6d %10d %12.2f %12.2f %12.0f\n", k, states, build * 1e3,
+               walk * 1e3, (build - walk) * 1e9 / states);
+
+        RE_free(re);
+        free(seen);
+        free(text);
+    }
+}
+
+static char *random_text(size_t len, const char *alphabet, unsigned seed)
+{
+    int n = strlen(alphabet);
+    char *text = malloc(len + 1);
+    srand(seed);
+    for (size_t i = 0; i < len; ++i) {
+        text[i] = alphabet[rand() % n];
+    }
+    text[len] = 0;
+    return text;
+}
+
+static void bench_fulldfa(void)
+{
+    static const char *reps[] = {
+        "abcd(e|f)gx",
+        "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)x",
+        "a?a?a?a?a?a?a?a?a?a?aaaaaaaaaax",
+        "(ab|ba)*(abc|bca)+x",
+    };
+    size_t len = 8 << 20;
+    char *text = random_text(len, "abcdefg", 1);
+
+    printf("%-40s %8s %10s %12s %12s %12s\n", "re", "states", "bytes",
+           "lazy(MB/s)", "bound(MB/s)", "full(MB/s)");
+    for (int i = 0; i < sizeof reps / sizeof reps[0]; ++i) {
+        RE *lazy = RE_compile(reps[i]);
+        RE_setoption(lazy, RE_DFA);
+        double tl = time_match(lazy, text);
+        RE_free(lazy);
+
+        RE *bound = RE_compile(reps[i]);
+        RE_setoption(bound, RE_DFA);
+        RE_setoption(bound, RE_BOUND_MEM);
+        double tb = time_match(bound, text);
+        RE_free(bound);
+
+        RE *full = RE_compile(reps[i]);
+        RE_setoption(full, RE_FULL_DFA);
+        int nstates = 0;
+        size_t memsize = 0;
+        if (!RE_full_dfa_info(full, &nstates, &memsize)) {
+            printf("%-40s %8s\n", reps[i], "-");
+            RE_free(full);
+            continue;
+        }
+        double tf = time_match(full, text);
+        RE_free(full);
+
+        printf("%-40s %8d %10zu %12.0f %12.0f %12.0f\n", reps[i], nstates,
+               memsize, len / tl / 1e6, len / tb / 1e6, len / tf / 1e6);
+    }
+
+    free(text);
+}
+
+static void bench_prefilter(void)
+{
+    static const char *reps[] = {
+        "needlez",       // literal prefix
+        "q(a|b)z",       // one first byte
+        "(k|m)(a|b)z",   // first-byte set
+        "(ab|cd|ef)*z",  // frequent first bytes
+    };
+    size_t len = 8 << 20;
+    char *text = random_text(len, "abcdefghijklmnopqrst ", 2);
+
+    printf("%-20s %10s %10s %10s %10s\n", "re", "nfa", "nfa+pf", "dfa", "dfa+pf");
+    for (int i = 0; i < sizeof reps / sizeof reps[0]; ++i) {
+        double mbs[4];
+        for (int j = 0; j < 4; ++j) {
+            RE *re = RE_compile(reps[i]);
+            if (j >= 2) {
+                RE_setoption(re, RE_DFA);
+            }
+            if (j % 2 == 0) {
+                RE_setoption(re, RE_NO_PREFILTER);
+            }
+            time_match(re, text); // warm up the DFA
+            mbs[j] = len / time_match(re, text) / 1e6;
+            RE_free(re);
+        }
+        printf("%-20s %10.0f %10.0f %10.0f %10.0f\n", reps[i], mbs[0], mbs[1],
+               mbs[2], mbs[3]);
+    }
+
+    free(text);
+}
+
+static void bench_set(void)
+{
+    // no pattern matches, so every scan covers the whole text
+    static const char letters[] = "bcdfghijklmnopqrstuvw";
+    size_t len = 1 << 20;
+    char *text = random_text(len, letters, 3);
+
+    printf("%8s %14s %14s\n", "patterns", "each(MB/s)", "set(MB/s)");
+    for (int n = 10; n <= 1000; n *= 10) {
+        char **pats = malloc(sizeof(char*) * n);
+        srand(n);
+        for (int i = 0; i < n; ++i) {
+            pats[i] = malloc(16);
+            for (int j = 0; j < 4; ++j) {
+                pats[i][j] = letters[rand() % (sizeof letters - 1)];
+            }
+            strcpy(pats[i] + 4, "(a|e)");
+        }
+
+        RE **res = malloc(sizeof(RE*) * n);
+        for (int i = 0; i < n; ++i) {
+            res[i] = RE_compile(pats[i]);
+            RE_setoption(res[i], RE_DFA);
+        }
+        double t = now();
+        for (int i = 0; i < n; ++i) {
+            RE_match(res[i], text);
+        }
+        double each = now() - t;
+
+        RESet *set = RESet_compile((const char **)pats, n);
+        unsigned char *matched = malloc((n + 7) / 8);
+        RESet_match(set, text, matched); // warm up the DFA
+        t = now();
+        RESet_match(set, text, matched);
+        double all = now() - t;
+
+        printf("%8d %14.1f %14.1f\n", n, len / each / 1e6, len / all / 1e6);
+
+        RESet_free(set);
+        free(matched);
+        for (int i = 0; i < n; ++i) {
+            RE_free(res[i]);
+            free(pats[i]);
+        }
+        free(res);
+        free(pats);
+    }
+
+    free(text);
+}
+
+static double mbs_match(RE *re, const char *text, size_t len)
+{
+    return len / time_match(re, text) / 1e6;
+}
+
+// `w1|w2|...` over random words ending in z, on a text without z, and as
+// `(w1|w2|...)`, which still gets the automaton. The NFA and the bounded
+// DFA drag the whole start closure along every byte, so they only get a
+// slice of the text.
+static void bench_literals(void)
+{
+    size_t len = 4 << 20, slice = 4 << 10;
+    char *text = random_text(len, "abcdefghijklmnopqrstuvwxy ", 4);
+    char *short_text = strndup(text, slice);
+
+    printf("%8s %12s %12s %12s %12s %12s %12s\n", "literals", "states",
+           "compile(ms)", "ac(MB/s)", "(ac)(MB/s)", "dfa(MB/s)", "nfa(MB/s)");
+    for (int n = 100; n <= 10000; n *= 10) {
+        char *group = malloc(n * 12 + 2);
+        char *rep = group + 1;
+        char *p = rep;
+        srand(n);
+        for (int i = 0; i < n; ++i) {
+            if (i) {
+                *p++ = '|';
+            }
+            for (int j = 4 + rand() % 6; j > 0; --j) {
+                *p++ = 'a' + rand() % 25;
+            }
+            *p++ = 'z';
+        }
+        *p = 0;
+
+        double t = now();
+        RE *ac = RE_compile(rep);
+        double compile = now() - t;
+        int nstates = 0;
+        RE_full_dfa_info(ac, &nstates, NULL);
+        double mac = mbs_match(ac, text, len);
+        RE_free(ac);
+
+        group[0] = '(';
+        strcpy(p, ")");
+        RE *gac = RE_compile(group);
+        double mgac = mbs_match(gac, text, len);
+        RE_free(gac);
+        *p = 0;
+
+        RE *dfa = RE_compile(rep);
+        RE_setoption(dfa, RE_NO_AHOCORASICK);
+        RE_setoption(dfa, RE_DFA);
+        RE_setoption(dfa, RE_BOUND_MEM);
+        double mdfa = mbs_match(dfa, short_text, slice);
+        RE_free(dfa);
+
+        RE *nfa = RE_compile(rep);
+        RE_setoption(nfa, RE_NO_AHOCORASICK);
+        double mnfa = mbs_match(nfa, short_text, slice);
+        RE_free(nfa);
+
+        printf("%8d %12d %12.2f %12.1f %12.1f %12.3f %12.3f\n", n, nstates,
+               compile * 1e3, mac, mgac, mdfa, mnfa);
+        free(group);
+    }
+
+    free(short_text);
+    free(text);
+}
+
+// compile and match one short input, the way igrep runs a pattern;
+// averaged over 100 runs
+static double first_call(const char *rep, const char *s, int opts)
+{
+    double t = now();
+    for (int i = 0; i < 100; ++i) {
+        RE *re = RE_compile(rep);
+        for (int opt = 1; opt <= opts; opt <<= 1) {
+            if (opts & opt) {
+                RE_setoption(re, opt);
+            }
+        }
+        time_match(re, s);
+        RE_free(re);
+    }
+    return (now() - t) / 100;
+}
+
+// the `a?^n a^n` pattern of test.sh, ending in b instead so that a text of
+// a's never matches. On a short input the lazy DFA spends its time creating
+// states, the bit-parallel NFA costs the same per byte whatever n is. The
+// throughput columns are the bit-parallel NFA, the lazy DFA on its first
+// (dfa) and second (dfa2) scan, and the NFA, which only gets a slice.
+static void bench_bitnfa(void)
+{
+    size_t len = 1 << 20;
+    char *text = random_text(len, "a", 5);
+    char *short_text = strndup(text, 64);
+
+    printf("%6s %10s %10s %10s %12s %12s %12s %12s\n", "n", "bit(us)",
+           "dfa(us)", "bdfa(us)", "bit(MB/s)", "dfa(MB/s)", "dfa2(MB/s)",
+           "nfa(MB/s)");
+    for (int n = 4; n <= 32; n += 4) {
+        char rep[3 * 32 + 1];
+        char *p = rep;
+        for (int i = 0; i < n; ++i) {
+            p += sprintf(p, "a?");
+        }
+        memset(p, 'a', n);
+        strcpy(p + n - 1, "b");
+
+        double lbit = first_call(rep, short_text, 0);
+        double ldfa = first_call(rep, short_text, RE_DFA | RE_NO_BITPARALLEL);
+        double lbdfa = first_call(rep, short_text,
+                                  RE_DFA | RE_BOUND_MEM | RE_NO_BITPARALLEL);
+
+        RE *bit = RE_compile(rep);
+        double mbit = mbs_match(bit, text, len);
+        RE_free(bit);
+
+        RE *dfa = RE_compile(rep);
+        RE_setoption(dfa, RE_NO_BITPARALLEL);
+        RE_setoption(dfa, RE_DFA);
+        double mdfa = mbs_match(dfa, text, len);
+        double mdfa2 = mbs_match(dfa, text, len);
+        RE_free(dfa);
+
+        RE *nfa = RE_compile(rep);
+        RE_setoption(nfa, RE_NO_BITPARALLEL);
+        double mnfa = mbs_match(nfa, text + len - (len >> 4), len >> 4);
+        RE_free(nfa);
+
+        printf("%6d %10.1f %10.1f %10.1f %12.0f %12.0f %12.0f %12.1f\n", n,
+               lbit * 1e6, ldfa * 1e6, lbdfa * 1e6, mbit, mdfa, mdfa2, mnfa);
+    }
+
+    free(short_text);
+    free(text);
+}
+
+static void bench_compile(void)
+{
+    static const char *reps[] = {
+        "abc",
+        "(a|b)*a(a|b)(a|b)(a|b)x",
+        "a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?a?b",
+        "((ab|cd)*(ef|gh)+(ij|kl)?)*(mn|op|qr|st|uv|wx|yz)+",
+    };
+    int runs = 100000;
+
+    printf("%-50s %12s\n", "re", "ns/compile");
+    for (int i = 0; i < sizeof reps / sizeof reps[0]; ++i) {
+        double t = now();
+        for (int j = 0; j < runs; ++j) {
+            RE_free(RE_compile(reps[i]));
+        }
+        printf("%-50s %12.0f\n", reps[i], (now() - t) * 1e9 / runs);
+    }
+}
+
+typedef struct {
+    RE *re;
+    const char *text;
+} Worker;
+
+static void *worker_run(void *arg)
+{
+    Worker *w = arg;
+    RE_ctx *ctx = RE_ctx_new(w->re);
+    if (RE_ctx_match(ctx, w->text)) {
+        fprintf(stderr, "unexpected match\n");
+        exit(1);
+    }
+    RE_ctx_free(ctx);
+    return NULL;
+}
+
+// every thread scans the same text through its own context on a fresh RE.
+// `(a|b)*a(a|b)^9c` has 1024 DFA states on an a/b text: private caches
+// build all of them once per thread, the shared one once in total.
+static double run_threads(const char *rep, int opts, const char *text, int n)
+{
+    RE *re = RE_compile(rep);
+    RE_setoption(re, opts);
+    pthread_t *tids = malloc(sizeof(pthread_t) * n);
+    Worker w = { re, text };
+
+    double t = now();
+    for (int i = 0; i < n; ++i) {
+        pthread_create(&tids[i], NULL, worker_run, &w);
+    }
+    for (int i = 0; i < n; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    t = now() - t;
+
+    free(tids);
+    RE_free(re);
+    return t;
+}
+
+static void bench_threads(void)
+{
+    const char *rep = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)c";
+    size_t len = 256 << 10;
+    char *text = random_text(len, "ab", 6);
+
+    printf("%8s %14s %14s %14s\n", "threads", "private(MB/s)", "shared(MB/s)",
+           "bounded(MB/s)");
+    for (int n = 1; n <= 64; n *= 2) {
+        double tp = run_threads(rep, RE_DFA, text, n);
+        double ts = run_threads(rep, RE_SHARED_DFA, text, n);
+        double tb = run_threads(rep, RE_SHARED_DFA | RE_BOUND_MEM
+                                | RE_NO_BITPARALLEL, text, n);
+        printf("%8d %14.0f %14.0f %14.0f\n", n, n * len / tp / 1e6,
+               n * len / ts / 1e6, n * len / tb / 1e6);
+    }
+
+    free(text);
+}
+
+// after one warm-up call, a match should not touch the heap whatever the
+// engine. The bounded DFA only stays off the heap while its states fit,
+// which they do here. Exits 1 if any engine allocates, for make test.
+static void bench_allocs(void)
+{
+    static const struct {
+        const char *name;
+        const char *rep;
+        int opts;
+    } cases[] = {
+        { "nfa", "(a|b)*abb(a|b)", RE_NO_BITPARALLEL },
+        { "bitnfa", "(a|b)*abb(a|b)", 0 },
+        { "dfa", "(a|b)*abb(a|b)", RE_DFA },
+        { "dfa-bound", "(a|b)*abb(a|b)", RE_DFA | RE_BOUND_MEM | RE_NO_BITPARALLEL },
+        { "full-dfa", "(a|b)*abb(a|b)", RE_FULL_DFA },
+        { "ahocorasick", "abbc|babc|bbac", 0 },
+        { "shared-dfa", "(a|b)*abb(a|b)", RE_SHARED_DFA },
+    };
+    int runs = 1000, bad = 0;
+    char *text = random_text(4096, "ac", 7);
+
+    printf("%-12s %12s %12s\n", "engine", "RE_match", "RE_ctx_match");
+    for (int i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+        RE *re = RE_compile(cases[i].rep);
+        if (cases[i].opts) {
+            RE_setoption(re, cases[i].opts);
+        }
+        RE_ctx *ctx = RE_ctx_new(re);
+        time_match(re, text);
+        RE_ctx_match(ctx, text);
+
+        long n0 = alloc_count();
+        for (int j = 0; j < runs; ++j) {
+            time_match(re, text);
+        }
+        long n1 = alloc_count();
+        for (int j = 0; j < runs; ++j) {
+            RE_ctx_match(ctx, text);
+        }
+        long n2 = alloc_count();
+
+        printf("%-12s %12.2f %12.2f\n", cases[i].name, (double)(n1 - n0) / runs,
+               (double)(n2 - n1) / runs);
+        bad += n2 != n0;
+        RE_ctx_free(ctx);
+        RE_free(re);
+    }
+
+    free(text);
+    if (bad) {
+        fflush(stdout);
+        fprintf(stderr, "allocs: %d engines allocate in a warm match\n", bad);
+        exit(1);
+    }
+}
+
+// 100000 requests over 2000 patterns, a few of them hot, with caps that
+// hold all of the working set, part of it, and very little
+static void bench_cache(void)
+{
+    int npats = 2000, nreq = 100000;
+    char **pats = malloc(sizeof(char*) * npats);
+    int *reqs = malloc(sizeof(int) * nreq);
+    srand(8);
+    for (int i = 0; i < npats; ++i) {
+        pats[i] = malloc(32);
+        sprintf(pats[i], "(x|y)*%d(a|b)+z%d", i, i % 7);
+    }
+    for (int i = 0; i < nreq; ++i) {
+        // half the requests go to 1% of the patterns
+        reqs[i] = rand() % 2 ? rand() % (npats / 100) : rand() % npats;
+    }
+
+    double t = now();
+    for (int i = 0; i < nreq; ++i) {
+        RE_free(RE_compile(pats[reqs[i]]));
+    }
+    printf("%-12s %10s %10s %10s %10s %12s\n", "cap", "ns/get", "hits",
+           "misses", "evictions", "bytes");
+    printf("%-12s %10.0f\n", "no cache", (now() - t) * 1e9 / nreq);
+
+    for (size_t cap = 1 << 18; cap <= 1 << 26; cap <<= 4) {
+        RECache *c = RECache_new(cap);
+        t = now();
+        for (int i = 0; i < nreq; ++i) {
+            RECache_release(c, RECache_get(c, pats[reqs[i]], RE_DFA));
+        }
+        t = now() - t;
+
+        RECacheStats st;
+        RECache_stats(c, &st);
+        printf("%-12zu %10.0f %10lu %10lu %10lu %12zu\n", cap, t * 1e9 / nreq,
+               st.hits, st.misses, st.evictions, st.bytes);
+        RECache_free(c);
+    }
+
+    for (int i = 0; i < npats; ++i) {
+        free(pats[i]);
+    }
+    free(pats);
+    free(reqs);
+}
+
+// `a(a|b)...(a|b)c` with k = 12 over a text where `a` is rare, so the
+// DFA keeps to the few states of masks with a bit or two set, broken every
+// 4KB by a 64 byte run of random a/b that visits states seen once. A lazy
+// DFA budget smaller than all the states reached should still hold the hot
+// ones.
+static void bench_budget(void)
+{
+    int k = 12;
+    size_t len = 16 << 20;
+    char rep[4 * 16 + 3];
+    char *p = rep;
+    *p++ = 'a';
+    for (int i = 1; i < k; ++i) {
+        p += sprintf(p, "(a|b)");
+    }
+    strcpy(p, "c");
+
+    char *text = malloc(len + 1);
+    srand(9);
+    for (size_t i = 0; i < len; ++i) {
+        int cold = i % 4096 < 64;
+        text[i] = rand() % (cold ? 2 : 32) ? 'b' : 'a';
+    }
+    text[len] = 0;
+
+    printf("%-10s %10s %10s %10s %10s\n", "budget", "states", "built",
+           "evicted", "MB/s");
+    for (size_t budget = 16 << 10; budget <= 16 << 20; budget <<= 2) {
+        RE *re = RE_compile(rep);
+        RE_setoption(re, RE_NO_BITPARALLEL);
+        RE_setoption(re, RE_DFA);
+        if (budget < 16 << 20) {
+            RE_set_dfa_budget(re, budget);
+        }
+        double mbs = mbs_match(re, text, len);
+
+        int nstates;
+        REStats st;
+        RE_dfa_info(re, &nstates, NULL);
+        RE_stats(re, &st);
+        unsigned long built = st.dfa_states;
+        if (budget < 16 << 20) {
+            printf("%-10zu", budget);
+        } else {
+            printf("%-10s", "unbounded");
+        }
+        printf(" %10d %10lu %10lu %10.1f\n", nstates, built, built - nstates,
+               mbs);
+        RE_free(re);
+    }
+
+    free(text);
+}
+
+// `(a|b)*a(a|b)...(a|b)` with k-1 groups has 2^k DFA states, about all of
+// which a random a/b text visits, far more than a bounded DFA holds. It
+// would build a state every byte or two; once it notices, it hands the
+// search to the NFA simulation.
+static void bench_thrash(void)
+{
+    size_t len = 4 << 20;
+    char *text = random_text(len, "ab", 10);
+
+    printf("%6s %10s %10s %10s %10s\n", "k", "nfa(MB/s)", "bdfa(MB/s)",
+           "built", "fallbacks");
+    for (int k = 12; k <= 24; k += 4) {
+        char rep[5 * 24 + 8];
+        char *p = rep + sprintf(rep, "(a|b)*a");
+        for (int i = 1; i < k; ++i) {
+            p += sprintf(p, "(a|b)");
+        }
+        strcpy(p, "c");
+
+        RE *nfa = RE_compile(rep);
+        RE_setoption(nfa, RE_NO_BITPARALLEL);
+        double mnfa = mbs_match(nfa, text, len);
+        RE_free(nfa);
+
+        RE *re = RE_compile(rep);
+        RE_setoption(re, RE_NO_BITPARALLEL);
+        RE_setoption(re, RE_DFA);
+        RE_setoption(re, RE_BOUND_MEM);
+        double mbdfa = mbs_match(re, text, len);
+        REStats st;
+        RE_stats(re, &st);
+        printf("%6d %10.1f %10.1f %10lu %10lu\n", k, mnfa, mbdfa,
+               st.dfa_states, st.restarts);
+        RE_free(re);
+    }
+
+    free(text);
+}
+
+// RE_match on 64 strings of 64KB of random a/b, wrapped in the counters of
+// perfcount.h; each engine is warmed up by a first pass. The counters the
+// machine doesn't give print as -.
+static void bench_perf(void)
+{
+    static const struct {
+        const char *name;
+        int opts;
+    } modes[] = {
+        { "nfa", RE_NO_BITPARALLEL },
+        { "bitnfa", 0 },
+        { "dfa", RE_DFA },
+        { "dfa-bound", RE_DFA | RE_BOUND_MEM | RE_NO_BITPARALLEL },
+        { "full-dfa", RE_FULL_DFA },
+    };
+    const char *rep = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)c";
+    int ncalls = 64;
+    size_t len = 64 << 10;
+    char **strs = malloc(sizeof(char*) * ncalls);
+    for (int i = 0; i < ncalls; ++i) {
+        strs[i] = random_text(len, "ab", 11 + i);
+    }
+
+    PerfCount pc;
+    if (perf_open(&pc, 0, 0) == 0) {
+        printf("no counters: perf_event_open failed\n");
+        perf_close(&pc);
+        return;
+    }
+
+    printf("%-10s", "engine");
+    for (int k = 0; k < PC_NCOUNTERS; ++k) {
+        printf(" %14s", perf_names[k]);
+    }
+    printf(" %10s\n", "cycles/B");
+    for (int m = 0; m < (int)(sizeof modes / sizeof modes[0]); ++m) {
+        RE *re = RE_compile(rep);
+        RE_setoption(re, modes[m].opts);
+        for (int i = 0; i < ncalls; ++i) {
+            RE_match(re, strs[i]);
+        }
+
+        double v[PC_NCOUNTERS];
+        perf_start(&pc);
+        for (int i = 0; i < ncalls; ++i) {
+            RE_match(re, strs[i]);
+        }
+        perf_stop(&pc);
+        perf_read(&pc, v);
+
+        printf("%-10s", modes[m].name);
+        for (int k = 0; k < PC_NCOUNTERS; ++k) {
+            if (v[k] < 0) {
+                printf(" %14s", "-");
+            } else {
+                printf(" %14.0f", v[k] / ncalls);
+            }
+        }
+        if (v[PC_CYCLES] < 0) {
+            printf(" %10s\n", "-");
+        } else {
+            printf(" %10.2f\n", v[PC_CYCLES] / ncalls / len);
+        }
+        RE_free(re);
+    }
+
+    perf_close(&pc);
+    for (int i = 0; i < ncalls; ++i) {
+        free(strs[i]);
+    }
+    free(strs);
+}
+
+// access log lines, one after the other
+static char *log_text(size_t len, unsigned seed)
+{
+    static const char *methods[] = { "GET", "POST", "PUT", "DELETE", "HEAD" };
+    static const char *areas[] = { "api", "static", "admin", "img" };
+    static const char *res[] = { "users", "orders", "items", "logo" };
+    static const char *codes[] = { "200", "301", "404", "500", "302" };
+    char *text = malloc(len + 64);
+    size_t n = 0;
+    srand(seed);
+    while (n < len) {
+        n += sprintf(text + n, "%s /%s/%s/%d %s\n", methods[rand() % 5],
+                     areas[rand() % 4], res[rand() % 4], rand() % 100000,
+                     codes[rand() % 5]);
+    }
+    text[len] = 0;
+    return text;
+}
+
+// the lazy DFA against its RE_JIT code once both are warm, on texts that
+// never match. On random a/b every byte is a coin toss for the branches of
+// the compiled code, where the table walk has none; log lines are what
+// the JIT is for.
+static void bench_jit(void)
+{
+    static const struct {
+        const char *name;
+        const char *rep;
+    } cases[] = {
+        { "ab-kgram", "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)c" },
+        { "log", "(GET|POST|PUT|DELETE) /(api|static|admin)/"
+                 "(users|orders|items)/(0|1|2|3|4|5|6|7|8|9)+ 999" },
+        { "log-nopf", "(GET|POST|PUT|DELETE) /(api|static|admin)/"
+                      "(users|orders|items)/(0|1|2|3|4|5|6|7|8|9)+ 999" },
+    };
+    size_t len = 32 << 20;
+
+    printf("%-10s %10s %10s %10s %10s\n", "case", "states", "dfa(MB/s)",
+           "jit(MB/s)", "jit bytes");
+    for (int i = 0; i < (int)(sizeof cases / sizeof cases[0]); ++i) {
+        char *text = i ? log_text(len, 11) : random_text(len, "ab", 11);
+        double mbs[2];
+        REStats st;
+        int nstates;
+        for (int jit = 0; jit < 2; ++jit) {
+            RE *re = RE_compile(cases[i].rep);
+            RE_setoption(re, RE_NO_BITPARALLEL);
+            RE_setoption(re, jit ? RE_JIT : RE_DFA);
+            if (i == 2) {
+                RE_setoption(re, RE_NO_PREFILTER);
+            }
+            mbs_match(re, text, len);
+            mbs[jit] = mbs_match(re, text, len);
+            RE_dfa_info(re, &nstates, NULL);
+            RE_stats(re, &st);
+            RE_free(re);
+        }
+        printf("%-10s %10d %10.1f %10.1f %9.0f%%\n", cases[i].name, nstates,
+               mbs[0], mbs[1], 100.0 * st.jit_bytes / st.bytes);
+        free(text);
+    }
+}
+
+static struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    { "dstate", bench_dstate },
+    { "fulldfa", bench_fulldfa },
+    { "prefilter", bench_prefilter },
+    { "set", bench_set },
+    { "literals", bench_literals },
+    { "bitnfa", bench_bitnfa },
+    { "compile", bench_compile },
+    { "threads", bench_threads },
+    { "allocs", bench_allocs },
+    { "cache", bench_cache },
+    { "budget", bench_budget },
+    { "thrash", bench_thrash },
+    { "perf", bench_perf },
+    { "jit", bench_jit },
+};
+
+int main(int argc, char *argv[])
+{
+    int n = sizeof benches / sizeof benches[0];
+    for (int i = 0; i < n; ++i) {
+        if (argc < 2 || strcmp(argv[1], benches[i].name) == 0) {
+            printf("== %s\n", benches[i].name);
+            benches[i].fn();
+        }
+    }
+    return 0;
+}
@@ -355,68 +355,114 @@ struct DState
 {
 	List l;
 	DState *next[256];
-	DState *left;
-	DState *right;
+	unsigned long hash;
 };
 
-/* Compare lists: first by length, then by members. */
-static int
-listcmp(List *l1, List *l2)
+/* Hash a single NFA state. */
+static unsigned long
+statehash(State *s)
+{
+	unsigned long h;
+
+	h = (unsigned long)s;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Fingerprint of a state list: a sum of the
+ * member hashes does not depend on their order,
+ * so the list need not be sorted.
+ */
+static unsigned long
+listhash(List *l)
 {
 	int i;
+	unsigned long h;
 
-	if(l1->n < l2->n)
-		return -1;
-	if(l1->n > l2->n)
-		return 1;
-	for(i=0; i<l1->n; i++)
-		if(l1->s[i] < l2->s[i])
-			return -1;
-		else if(l1->s[i] > l2->s[i])
-			return 1;
-	return 0;
+	h = l->n;
+	for(i=0; i<l->n; i++)
+		h += statehash(l->s[i]);
+	return h;
 }
 
-/* Compare pointers by address. */
+/*
+ * Right after startlist or step, exactly the states
+ * in l carry the current listid, so d holds the same
+ * set if it has as many states and all are marked.
+ */
 static int
-ptrcmp(const void *a, const void *b)
+listeq(DState *d, List *l, unsigned long h)
 {
-	if(a < b)
-		return -1;
-	if(a > b)
-		return 1;
-	return 0;
+	int i;
+
+	if(d->hash != h || d->l.n != l->n)
+		return 0;
+	for(i=0; i<d->l.n; i++)
+		if(d->l.s[i]->lastlist != listid)
+			return 0;
+	return 1;
+}
+
+/*
+ * All DStates, in an open-addressing hash table
+ * with linear probing.  Size is a power of 2.
+ */
+DState **dtab;
+int ndtab;
+int ndstates;
+
+/* Double the table, keeping it at most half full. */
+static void
+growdtab(void)
+{
+	int i, j, n;
+	DState **t;
+
+	n = ndtab ? 2*ndtab : 64;
+	t = calloc(n, sizeof t[0]);
+	for(i=0; i<ndtab; i++){
+		if(dtab[i] == NULL)
+			continue;
+		for(j=dtab[i]->hash&(n-1); t[j]; j=(j+1)&(n-1))
+			;
+		t[j] = dtab[i];
+	}
+	free(dtab);
+	dtab = t;
+	ndtab = n;
 }
 
 /*
  * Return the cached DState for list l,
  * creating a new one if needed.
  */
-DState *alldstates;
 DState*
 dstate(List *l)
 {
 	int i;
-	DState **dp, *d;
-
-	qsort(l->s, l->n, sizeof l->s[0], ptrcmp);
-	dp = &alldstates;
-	while((d = *dp) != NULL){
-		i = listcmp(l, &d->l);
-		if(i < 0)
-			dp = &d->left;
-		else if(i > 0)
-			dp = &d->right;
-		else
+	unsigned long h;
+	DState *d;
+
+	if(2*(ndstates+1) > ndtab)
+		growdtab();
+	h = listhash(l);
+	for(i=h&(ndtab-1); (d = dtab[i]) != NULL; i=(i+1)&(ndtab-1))
+		if(listeq(d, l, h))
 			return d;
-	}
-	
+
 	d = malloc(sizeof *d + l->n*sizeof l->s[0]);
 	memset(d, 0, sizeof *d);
 	d->l.s = (State**)(d+1);
 	memmove(d->l.s, l->s, l->n*sizeof l->s[0]);
 	d->l.n = l->n;
-	*dp = d;
+	d->hash = h;
+	dtab[i] = d;
+	ndstates++;
 	return d;
 }
 
@@ -355,37 +355,87 @@ struct DState
 {
 	List l;
 	DState *next[256];
-	DState *left;
-	DState *right;
+	unsigned long hash;
+	int used;	/* entered since the last sweep */
+	DState *link;	/* free list */
 };
 
-/* Compare lists: first by length, then by members. */
-static int
-listcmp(List *l1, List *l2)
+/* Hash a single NFA state. */
+static unsigned long
+statehash(State *s)
+{
+	unsigned long h;
+
+	h = (unsigned long)s;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Fingerprint of a state list: a sum of the
+ * member hashes does not depend on their order,
+ * so the list need not be sorted.
+ */
+static unsigned long
+listhash(List *l)
 {
 	int i;
+	unsigned long h;
 
-	if(l1->n < l2->n)
-		return -1;
-	if(l1->n > l2->n)
-		return 1;
-	for(i=0; i<l1->n; i++)
-		if(l1->s[i] < l2->s[i])
-			return -1;
-		else if(l1->s[i] > l2->s[i])
-			return 1;
-	return 0;
+	h = l->n;
+	for(i=0; i<l->n; i++)
+		h += statehash(l->s[i]);
+	return h;
 }
 
-/* Compare pointers by address. */
+/*
+ * Right after startlist or step, exactly the states
+ * in l carry the current listid, so d holds the same
+ * set if it has as many states and all are marked.
+ */
 static int
-ptrcmp(const void *a, const void *b)
+listeq(DState *d, List *l, unsigned long h)
 {
-	if(a < b)
-		return -1;
-	if(a > b)
-		return 1;
-	return 0;
+	int i;
+
+	if(d->hash != h || d->l.n != l->n)
+		return 0;
+	for(i=0; i<d->l.n; i++)
+		if(d->l.s[i]->lastlist != listid)
+			return 0;
+	return 1;
+}
+
+/*
+ * All DStates, in an open-addressing hash table
+ * with linear probing.  Size is a power of 2.
+ */
+DState **dtab;
+int ndtab;
+
+/* Double the table, keeping it at most half full. */
+static void
+growdtab(void)
+{
+	int i, j, n;
+	DState **t;
+
+	n = ndtab ? 2*ndtab : 64;
+	t = calloc(n, sizeof t[0]);
+	for(i=0; i<ndtab; i++){
+		if(dtab[i] == NULL)
+			continue;
+		for(j=dtab[i]->hash&(n-1); t[j]; j=(j+1)&(n-1))
+			;
+		t[j] = dtab[i];
+	}
+	free(dtab);
+	dtab = t;
+	ndtab = n;
 }
 
 DState *freelist;
@@ -397,77 +447,102 @@ allocdstate(void)
 	DState *d;
 	
 	if((d = freelist) != NULL)
-		freelist = d->left;
+		freelist = d->link;
 	else{
 		d = malloc(sizeof *d + nstate*sizeof(State*));
 		d->l.s = (State**)(d+1);
 	}
-	d->left = NULL;
-	d->right = NULL;
+	d->link = NULL;
 	memset(d->next, 0, sizeof d->next);
 	return d;
 }
 
-/* Free the tree of states rooted at d. */
-void
-freestates(DState *d)
+static int nstates;
+DState *startd;
+
+/*
+ * Bytes of DStates to keep.  Past it, sweep
+ * evicts the states not entered since the
+ * last sweep, as in the CLOCK algorithm, and
+ * clears the bits of the rest.  If that does
+ * not free half, it evicts all but keep and
+ * the start state.
+ */
+long maxbytes = 64*1024;
+
+static long
+dstatesize(void)
 {
-	if(d == NULL)
-		return;
-	freestates(d->left);
-	freestates(d->right);
-	d->left = freelist;
-	freelist = d;
+	return sizeof(DState) + nstate*sizeof(State*);
 }
 
-static DState *alldstates;
-static int nstates;
-
-/* Throw away the cache and start over. */
-void
-freecache(void)
+static void
+sweep(DState *keep)
 {
-	freestates(alldstates);
-	alldstates = NULL;
-	nstates = 0;
+	int i, j, c, all;
+	DState *d, **t;
+
+	for(all=0; all<2 && 2*nstates*dstatesize() > maxbytes; all++)
+		for(i=0; i<ndtab; i++){
+			d = dtab[i];
+			if(d == NULL || d->used < 0 || (d->used && !all))
+				continue;
+			if(d == keep || d == startd)
+				continue;
+			d->used = -1;
+			nstates--;
+		}
+
+	t = calloc(ndtab, sizeof t[0]);
+	for(i=0; i<ndtab; i++){
+		if((d = dtab[i]) == NULL)
+			continue;
+		if(d->used < 0){
+			d->link = freelist;
+			freelist = d;
+			continue;
+		}
+		for(c=0; c<256; c++)
+			if(d->next[c] != NULL && d->next[c]->used < 0)
+				d->next[c] = NULL;
+		d->used = 0;
+		for(j=d->hash&(ndtab-1); t[j]; j=(j+1)&(ndtab-1))
+			;
+		t[j] = d;
+	}
+	free(dtab);
+	dtab = t;
 }
 
 /*
  * Return the cached DState for list l,
  * creating a new one if needed.
  */
-int maxstates = 32;
 DState*
 dstate(List *l, DState **nextp)
 {
 	int i;
-	DState **dp, *d;
-
-	qsort(l->s, l->n, sizeof l->s[0], ptrcmp);
-	dp = &alldstates;
-	while((d = *dp) != NULL){
-		i = listcmp(l, &d->l);
-		if(i < 0)
-			dp = &d->left;
-		else if(i > 0)
-			dp = &d->right;
-		else
+	unsigned long h;
+	DState *d;
+
+	if(2*(nstates+1) > ndtab)
+		growdtab();
+	h = listhash(l);
+	for(i=h&(ndtab-1); (d = dtab[i]) != NULL; i=(i+1)&(ndtab-1))
+		if(listeq(d, l, h))
 			return d;
-	}
 
-	if(nstates >= maxstates){
-		freecache();
-		dp = &alldstates;
-		nextp = NULL;
-	}
-	
 	d = allocdstate();
 	memmove(d->l.s, l->s, l->n*sizeof l->s[0]);
 	d->l.n = l->n;
-	*dp = d;
+	d->hash = h;
+	d->used = 1;
+	dtab[i] = d;
 	nstates++;
 	if(nextp != NULL)
 		*nextp = d;
+	if(nstates*dstatesize() > maxbytes)
+		sweep(d);
 	return d;
 }
 
@@ -482,7 +557,8 @@ startnfa(State *start, List *l)
 DState*
 startdstate(State *start)
 {
-	return dstate(startlist(start, &l1), NULL);
+	startd = dstate(startlist(start, &l1), NULL);
+	return startd;
 }
 
 DState*
@@ -504,6 +580,7 @@ match(DState *start, char *s)
 		c = *s & 0xFF;
 		if((next = d->next[c]) == NULL)
 			next = nextstate(d, c);
+		next->used = 1;
 		d = next;
 	}
 	return ismatch(&d->l);
@@ -0,0 +1,524 @@
+// runs every engine of the repo over the same corpus, the way each is run
+// from the shell: `engine regexp string...`, one child process per run
+//
+// usage: enginebench [-j] [-p] [case]
+//   -j  JSON instead of CSV
+//   -p  hardware counters of the children too
+//
+// For each case and engine it reports
+//   compile_ms  a run on the empty string less a run of the pattern `a`
+//   mb_s        corpus bytes over the time a run takes past that empty run
+//   peak_kb     largest resident set of the child over the corpus
+// and with -p, for each counter of perfcount.h, its count per string (one
+// match call each) past the empty run, and cycles per byte. Counters the
+// machine doesn't have are left empty, null in JSON.
+// Each figure is from the fastest of RUNS runs. The corpus is made from a
+// fixed seed.
+//
+// The Plan 9 engines (russ_nfa, dfa0, dfa1, nfa-posix) tell whether the
+// whole string matches, thompson_nfa, revm and the regexp-x86 JIT search
+// for a match in it.
+// The cases are built so both do about the same work: patterns describe
+// whole strings, and long strings don't match at all.
+//
+// enginebench --run nfa|bitnfa|dfa regexp string... is the thompson_nfa
+// engine behind the same interface: nfa is Thompson simulation alone,
+// bitnfa lets patterns of at most 64 positions take the bit-parallel NFA.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "nfa.h"
+#include "perfcount.h"
+
+#define RUNS 3
+
+typedef struct Engine {
+    const char *name;
+    const char *path;
+    const char *mode; // for --run, NULL for a program of its own
+} Engine;
+
+static Engine engines[] = {
+    { "thompson-nfa", "./enginebench", "nfa" },
+    { "thompson-bitnfa", "./enginebench", "bitnfa" },
+    { "thompson-dfa", "./enginebench", "dfa" },
+    { "russ_nfa", "./russ_nfa", NULL },
+    { "dfa0", "./dfa0", NULL },
+    { "dfa1", "./dfa1", NULL },
+    { "revm", "./igrepvm-opt", NULL },
+    { "nfa-posix", "./nfa-posix", NULL },
+    { "x86-jit", "./regexp-x86", NULL },
+};
+
+typedef struct Sample {
+    double t;      // wall time, -1 if the engine failed
+    long peak_kb;
+    double pc[PC_NCOUNTERS];
+} Sample;
+
+static int use_perf;
+
+typedef struct Case {
+    const char *name;
+    char *rep;
+    char **strs;
+    int nstrs;
+    size_t bytes;
+} Case;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Children are not forked from here but by a spawner, forked before any
+// corpus is made: Linux counts the resident set a child had before exec, a
+// copy of its parent's, in its peak, and ours holds the corpus of a case.
+// The spawner is sent the argv of a run as one block of strings, and sends
+// back the child's pid, then its status, peak and the time from fork to
+// its end. The counters start at exec, the child waits on go for them to
+// be open.
+static int spawn_req = -1, spawn_res = -1, spawn_go = -1;
+
+static int readall(int fd, void *buf, size_t n)
+{
+    for (char *p = buf; n > 0; ) {
+        ssize_t k = read(fd, p, n);
+        if (k <= 0) {
+            return -1;
+        }
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static void writeall(int fd, const void *buf, size_t n)
+{
+    for (const char *p = buf; n > 0; ) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0) {
+            perror("write");
+            exit(1);
+        }
+        p += k;
+        n -= k;
+    }
+}
+
+// the block is mapped rather than malloc'd so the spawner is back to its
+// own few pages once a child is forked
+static void spawner(int req, int res, int go)
+{
+    size_t len;
+    while (readall(req, &len, sizeof len) == 0) {
+        size_t size = len + sizeof(char*) * (len + 1);
+        char *block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED || readall(req, block, len) < 0) {
+            _exit(1);
+        }
+        char **argv = (char **)(block + (len + sizeof(char*) - 1)
+                                / sizeof(char*) * sizeof(char*));
+        int argc = 0;
+        for (size_t i = 0; i < len; i += strlen(block + i) + 1) {
+            argv[argc++] = block + i;
+        }
+        argv[argc] = NULL;
+
+        double t = now();
+        pid_t pid = fork();
+        if (pid == 0) {
+            char c;
+            close(req);
+            close(res);
+            if (read(go, &c, 1) != 1) {
+                _exit(127);
+            }
+            close(go);
+            int fd = open("/dev/null", O_WRONLY);
+            dup2(fd, 1);
+            dup2(fd, 2);
+            execv(argv[0], argv);
+            _exit(127);
+        }
+        munmap(block, size);
+
+        int status = 127 << 8;
+        struct rusage ru = { .ru_maxrss = 0 };
+        writeall(res, &pid, sizeof pid);
+        if (pid > 0) {
+            wait4(pid, &status, 0, &ru);
+        }
+        t = now() - t;
+        writeall(res, &status, sizeof status);
+        writeall(res, &ru.ru_maxrss, sizeof ru.ru_maxrss);
+        writeall(res, &t, sizeof t);
+    }
+    _exit(0);
+}
+
+static void start_spawner(void)
+{
+    int req[2], res[2], go[2];
+    if (pipe(req) < 0 || pipe(res) < 0 || pipe(go) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(req[1]);
+        close(res[0]);
+        close(go[1]);
+        spawner(req[0], res[1], go[0]);
+    }
+    close(req[0]);
+    close(res[1]);
+    close(go[0]);
+    spawn_req = req[1];
+    spawn_res = res[0];
+    spawn_go = go[1];
+}
+
+// run e on rep and strs with its output thrown away
+static Sample run(const Engine *e, const char *rep, char **strs, int n)
+{
+    Sample r = { -1 };
+    const char *head[4];
+    int nhead = 0;
+    head[nhead++] = e->path;
+    if (e->mode) {
+        head[nhead++] = "--run";
+        head[nhead++] = e->mode;
+    }
+    head[nhead++] = rep;
+
+    size_t len = 0;
+    for (int i = 0; i < nhead; ++i) {
+        len += strlen(head[i]) + 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        len += strlen(strs[i]) + 1;
+    }
+    char *block = malloc(len), *p = block;
+    for (int i = 0; i < nhead; ++i) {
+        p = stpcpy(p, head[i]) + 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        p = stpcpy(p, strs[i]) + 1;
+    }
+
+    writeall(spawn_req, &len, sizeof len);
+    writeall(spawn_req, block, len);
+    free(block);
+
+    pid_t pid;
+    int status;
+    long peak_kb;
+    double t;
+    PerfCount pc;
+    if (readall(spawn_res, &pid, sizeof pid) < 0) {
+        fprintf(stderr, "enginebench: spawner died\n");
+        exit(1);
+    }
+    if (pid > 0) {
+        if (use_perf) {
+            perf_open(&pc, pid, 1);
+        }
+        writeall(spawn_go, "", 1);
+    }
+    if (readall(spawn_res, &status, sizeof status) < 0
+        || readall(spawn_res, &peak_kb, sizeof peak_kb) < 0
+        || readall(spawn_res, &t, sizeof t) < 0) {
+        fprintf(stderr, "enginebench: spawner died\n");
+        exit(1);
+    }
+    r.t = t;
+    if (pid > 0 && use_perf) {
+        perf_read(&pc, r.pc);
+        perf_close(&pc);
+    }
+
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        r.t = -1;
+    }
+    r.peak_kb = peak_kb;
+    return r;
+}
+
+static Sample best(const Engine *e, const char *rep, char **strs, int n)
+{
+    Sample min = { -1 };
+    for (int i = 0; i < RUNS; ++i) {
+        Sample s = run(e, rep, strs, n);
+        if (s.t < 0) {
+            return s;
+        }
+        if (min.t < 0 || s.t < min.t) {
+            min = s;
+        }
+    }
+    return min;
+}
+
+static void add_str(Case *c, const char *s)
+{
+    c->strs = realloc(c->strs, sizeof(char*) * (c->nstrs + 1));
+    c->strs[c->nstrs++] = strdup(s);
+    c->bytes += strlen(s);
+}
+
+// give the corpus back to the system before the next case is made
+static void free_case(Case *c)
+{
+    for (int i = 0; i < c->nstrs; ++i) {
+        free(c->strs[i]);
+    }
+    free(c->strs);
+    free(c->rep);
+    malloc_trim(0);
+}
+
+static char *repeat(const char *s, int n)
+{
+    size_t len = strlen(s);
+    char *r = malloc(len * n + 1);
+    for (int i = 0; i < n; ++i) {
+        memcpy(r + len * i, s, len);
+    }
+    r[len * n] = 0;
+    return r;
+}
+
+// `(a?)^n a^n` on a^n, the NFA keeps every state alive. nfa-posix wants
+// repetitions parenthesized, so all engines get them that way.
+static void make_pathological(Case *c)
+{
+    int n = 20;
+    char *q = repeat("(a?)", n);
+    char *a = repeat("a", n);
+    c->rep = malloc(strlen(q) + n + 1);
+    sprintf(c->rep, "%s%s", q, a);
+    for (int i = 0; i < 20000; ++i) {
+        add_str(c, a);
+    }
+    free(q);
+    free(a);
+}
+
+// access log lines, most of them of the shape the pattern spells out
+static void make_loglines(Case *c)
+{
+    static const char *methods[] = { "GET", "POST", "PUT", "DELETE", "HEAD" };
+    static const char *areas[] = { "api", "static", "admin", "img" };
+    static const char *res[] = { "users", "orders", "items", "logo" };
+    static const char *codes[] = { "200", "301", "404", "500", "302" };
+
+    c->rep = strdup("(GET|POST|PUT|DELETE) /(api|static|admin)/"
+                    "(users|orders|items)/(0|1|2|3|4|5|6|7|8|9)+ "
+                    "(200|301|404|500)");
+    for (int i = 0; i < 20000; ++i) {
+        char s[64];
+        sprintf(s, "%s /%s/%s/%d %s", methods[rand() % 5], areas[rand() % 4],
+                res[rand() % 4], rand() % 100000, codes[rand() % 5]);
+        add_str(c, s);
+    }
+}
+
+static char *random_word(void)
+{
+    int len = 6 + rand() % 5;
+    char *w = malloc(len + 1);
+    for (int i = 0; i < len; ++i) {
+        w[i] = 'a' + rand() % 26;
+    }
+    w[len] = 0;
+    return w;
+}
+
+// `(w1|w2|...)` over 300 words, half the strings among them
+static void make_alternation(Case *c)
+{
+    int nwords = 300;
+    char **words = malloc(sizeof(char*) * nwords);
+    size_t len = 3;
+    for (int i = 0; i < nwords; ++i) {
+        words[i] = random_word();
+        len += strlen(words[i]) + 1;
+    }
+
+    char *p = c->rep = malloc(len);
+    *p++ = '(';
+    for (int i = 0; i < nwords; ++i) {
+        p += sprintf(p, i ? "|%s" : "%s", words[i]);
+    }
+    strcpy(p, ")");
+
+    for (int i = 0; i < 50000; ++i) {
+        if (rand() % 2) {
+            add_str(c, words[rand() % nwords]);
+        } else {
+            char *w = random_word();
+            add_str(c, w);
+            free(w);
+        }
+    }
+
+    for (int i = 0; i < nwords; ++i) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+// strings of 120KB of random a/b, close to the kernel's limit on one
+// argument, that no engine can stop early on
+static void make_long(Case *c)
+{
+    c->rep = strdup("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)c");
+    for (int i = 0; i < 8; ++i) {
+        int len = 120000;
+        char *s = malloc(len + 1);
+        for (int j = 0; j < len; ++j) {
+            s[j] = "ab"[rand() % 2];
+        }
+        s[len] = 0;
+        add_str(c, s);
+        free(s);
+    }
+}
+
+static struct {
+    const char *name;
+    void (*make)(Case *c);
+} cases[] = {
+    { "pathological", make_pathological },
+    { "loglines", make_loglines },
+    { "alternation", make_alternation },
+    { "long", make_long },
+};
+
+static int run_thompson(int argc, char *argv[])
+{
+    RE *re = RE_compile(argv[1]);
+    if (strcmp(argv[0], "dfa") == 0) {
+        RE_setoption(re, RE_DFA);
+    } else if (strcmp(argv[0], "nfa") == 0) {
+        RE_setoption(re, RE_NO_BITPARALLEL);
+    }
+    for (int i = 2; i < argc; ++i) {
+        if (RE_match(re, argv[i])) {
+            printf("%s\n", argv[i]);
+        }
+    }
+    RE_free(re);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 4 && strcmp(argv[1], "--run") == 0) {
+        return run_thompson(argc - 2, argv + 2);
+    }
+
+    int json = 0;
+    for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+        if (strcmp(argv[1], "-j") == 0) {
+            json = 1;
+        } else if (strcmp(argv[1], "-p") == 0) {
+            use_perf = 1;
+        } else {
+            fprintf(stderr, "usage: enginebench [-j] [-p] [case]\n");
+            return 1;
+        }
+    }
+
+    start_spawner();
+    char *empty[] = { "" };
+    int first = 1;
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("case,engine,bytes,compile_ms,mb_s,peak_kb");
+        for (int k = 0; use_perf && k < PC_NCOUNTERS; ++k) {
+            printf(",%s_call", perf_names[k]);
+        }
+        printf(use_perf ? ",cycles_b\n" : "\n");
+    }
+
+    int ncases = sizeof cases / sizeof cases[0];
+    int nengines = sizeof engines / sizeof engines[0];
+    for (int i = 0; i < ncases; ++i) {
+        if (argc > 1 && strcmp(argv[1], cases[i].name) != 0) {
+            continue;
+        }
+
+        Case c = { cases[i].name };
+        srand(i + 1);
+        cases[i].make(&c);
+
+        for (int j = 0; j < nengines; ++j) {
+            const Engine *e = &engines[j];
+            Sample base = best(e, "a", empty, 1);
+            Sample empty_run = best(e, c.rep, empty, 1);
+            Sample full = best(e, c.rep, c.strs, c.nstrs);
+            if (base.t < 0 || empty_run.t < 0 || full.t < 0) {
+                fprintf(stderr, "%s: %s failed or is not built\n", c.name,
+                        e->name);
+                continue;
+            }
+
+            double compile_ms = empty_run.t > base.t
+                ? (empty_run.t - base.t) * 1e3 : 0;
+            double scan = full.t > empty_run.t ? full.t - empty_run.t : 1e-9;
+            double mbs = c.bytes / scan / 1e6;
+            if (json) {
+                printf("%s  {\"case\": \"%s\", \"engine\": \"%s\", \"bytes\": %zu, "
+                       "\"compile_ms\": %.3f, \"mb_s\": %.2f, \"peak_kb\": %ld",
+                       first ? "" : ",\n", c.name, e->name, c.bytes,
+                       compile_ms, mbs, full.peak_kb);
+            } else {
+                printf("%s,%s,%zu,%.3f,%.2f,%ld", c.name, e->name, c.bytes,
+                       compile_ms, mbs, full.peak_kb);
+            }
+
+            // counts of the matching alone, per call and per byte
+            for (int k = 0; use_perf && k <= PC_NCOUNTERS; ++k) {
+                int kk = k < PC_NCOUNTERS ? k : PC_CYCLES;
+                double d = full.pc[kk] - empty_run.pc[kk];
+                double v = k < PC_NCOUNTERS ? d / c.nstrs : d / c.bytes;
+                int known = full.pc[kk] >= 0 && empty_run.pc[kk] >= 0;
+                if (json) {
+                    printf(", \"%s%s\": ", perf_names[kk],
+                           k < PC_NCOUNTERS ? "_call" : "_b");
+                    printf(known ? "%.2f" : "null", v);
+                } else {
+                    printf(known ? ",%.2f" : ",", v);
+                }
+            }
+            printf(json ? "}" : "\n");
+            first = 0;
+            fflush(stdout);
+        }
+        free_case(&c);
+    }
+
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
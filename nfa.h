@@ -1,6 +1,8 @@
 #ifndef _NFA_H
 #define _NFA_H
 
+#include <stddef.h>
+
 struct State_;
 struct REprivate_;
 
@@ -9,13 +11,115 @@ typedef struct RE_ {
     struct REprivate_ *priv;
 } RE;
 
-
-RE re;
+enum RE_option {
+    RE_DFA = 0x01, // build DFA on-the-fly
+    RE_DUMP = 0x02,  // dump automata transitions
+    RE_BOUND_MEM = 0x04,  // bounded memory usage by DFA, see RE_set_dfa_budget
+    RE_ANCHOR_HEAD = 0x08, // ^, search only from first
+    RE_ANCHOR_TAIL = 0x10, // $
+    RE_FULL_DFA = 0x20, // build the complete, minimized DFA up front
+    RE_NO_PREFILTER = 0x40, // don't skip ahead to where a match can start
+    RE_NO_AHOCORASICK = 0x80, // run literal alternations like other patterns
+    RE_NO_BITPARALLEL = 0x100, // don't use the bit-parallel NFA for small patterns
+    RE_SHARED_DFA = 0x200, // one lazy DFA for all contexts, implies RE_DFA
+    RE_JIT = 0x400, // compile a hot lazy DFA to x86-64 code, implies RE_DFA
+};
 
 // compile rep represented regex into RE_
 RE *RE_compile(const char *rep);
+// write the RE_FULL_DFA table of re to path, return 0 or -1 with errno set
+int RE_save(RE *re, const char *path);
+// map a file written by RE_save read-only, NULL with errno set on failure;
+// a file whose table would index outside itself fails with EINVAL
+RE *RE_load(const char *path);
 // return 1 if matched, else 0
 int RE_match(RE *re, const char *str);
 void RE_free(RE *re);
 
+void RE_setoption(RE *re, enum RE_option opt);
+int RE_getoption(RE *re, enum RE_option opt);
+
+// a set of patterns matched in one scan of the input
+typedef struct RESet_ {
+    RE *re;
+    int npats;
+} RESet;
+
+// compile n patterns into one automaton, pattern i reports as bit i
+RESet *RESet_compile(const char **pats, int n);
+// set bit i of matched, (npats + 7) / 8 bytes, for every pattern i found
+// in str; return the number of patterns that matched
+int RESet_match(RESet *set, const char *str, unsigned char *matched);
+void RESet_free(RESet *set);
+
+// match state of one thread. A compiled RE is only read while matching, so
+// threads share it with no locks, each matching through its own RE_ctx.
+// RE_match uses the RE's own context. Set all options before RE_ctx_new.
+typedef struct RE_ctx_ RE_ctx;
+
+RE_ctx *RE_ctx_new(RE *re);
+int RE_ctx_match(RE_ctx *ctx, const char *str);
+void RE_ctx_free(RE_ctx *ctx);
+
+// counters kept by every match, all of them since the context was created
+typedef struct REStats_ {
+    unsigned long searches;
+    unsigned long bitnfa;     // of them run by the bit-parallel NFA, no NFA or DFA counts
+    unsigned long bytes;      // stepped by an automaton, prefilter skips aside
+    unsigned long nfa_steps;  // state list steps, lazy DFA misses included
+    unsigned long dfa_states; // lazy DFA states built, evicted ones included
+    unsigned long dfa_hits;   // bytes that took a lazy DFA transition built before
+    unsigned long dfa_misses; // bytes that built one
+    unsigned long flushes;    // whole lazy DFA dropped (shared: generations)
+    unsigned long sweeps;     // lazy DFA over its budget evicting states
+    unsigned long restarts;   // searches a thrashing DFA handed to the NFA
+    unsigned long jit_builds; // lazy DFA compiled to machine code, RE_JIT
+    unsigned long jit_bytes;  // bytes stepped by that code, in dfa_hits too
+    int peak_list;            // most NFA States in one list
+    double compile_ms;        // RE_compile or RESet_compile
+} REStats;
+
+// the RE's own context plus every freed RE_ctx, contexts still in use
+// report through RE_ctx_stats
+void RE_stats(RE *re, REStats *out);
+void RE_ctx_stats(RE_ctx *ctx, REStats *out);
+
+// LRU cache of compiled patterns, keyed by pattern text and options, safe
+// to use from many threads. An RE from RECache_get is shared: match it
+// through an RE_ctx, don't change its options, and give it back with
+// RECache_release instead of RE_free.
+typedef struct RECache_ RECache;
+
+typedef struct RECacheStats_ {
+    unsigned long hits, misses;
+    unsigned long evictions;
+    size_t bytes;  // estimated heap of the cached REs
+    int entries;
+} RECacheStats;
+
+// maxbytes caps the estimated size of the REs kept
+RECache *RECache_new(size_t maxbytes);
+// the RE compiled from rep with options opts set, compiled on a miss
+RE *RECache_get(RECache *c, const char *rep, int opts);
+void RECache_release(RECache *c, RE *re);
+void RECache_stats(RECache *c, RECacheStats *out);
+// drop the cache; REs still held stay valid and are given back with
+// RECache_release as before, the last release frees the cache
+void RECache_free(RECache *c);
+
+// bytes of lazy DFA a context may keep before it evicts states, 64KB
+// under RE_BOUND_MEM if not set
+void RE_set_dfa_budget(RE *re, size_t bytes);
+// bytes a context's lazy DFA scans before RE_JIT compiles it, 1MB if not
+// set. It is compiled again, with the states built since, after twice as
+// many bytes each time. No JIT for RE_SHARED_DFA or a bounded lazy DFA.
+void RE_set_jit_threshold(RE *re, size_t bytes);
+// lazy DFA of the RE's own context: states and bytes now held
+void RE_dfa_info(RE *re, int *nstates, size_t *bytes);
+
+// state budget of RE_FULL_DFA, set it before the option
+void RE_set_full_dfa_limit(RE *re, int maxstates);
+// size of the full DFA, return 0 if there is none
+int RE_full_dfa_info(RE *re, int *nstates, size_t *memsize);
+
 #endif
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfcount.h"
+
+const char *perf_names[PC_NCOUNTERS] = {
+    "cycles",
+    "instructions",
+    "branch_misses",
+    "l1d_misses",
+    "llc_misses",
+    "dtlb_misses",
+    "task_clock_ns",
+};
+
+static uint64_t cache_miss(int cache)
+{
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8
+        | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+}
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PC_NCOUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, 0 }, // config from cache_miss
+    { PERF_TYPE_HW_CACHE, 0 },
+    { PERF_TYPE_HW_CACHE, 0 },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+int perf_open(PerfCount *pc, pid_t pid, int on_exec)
+{
+    int n = 0;
+    for (int i = 0; i < PC_NCOUNTERS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        if (i == PC_L1D_MISSES) {
+            attr.config = cache_miss(PERF_COUNT_HW_CACHE_L1D);
+        } else if (i == PC_LLC_MISSES) {
+            attr.config = cache_miss(PERF_COUNT_HW_CACHE_LL);
+        } else if (i == PC_DTLB_MISSES) {
+            attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+        }
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.enable_on_exec = on_exec;
+        attr.inherit = on_exec;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // one counter per fd rather than a group: a group the PMU can't
+        // hold at once would never run, single ones are multiplexed
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        if (pc->fd[i] >= 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+void perf_start(PerfCount *pc)
+{
+    for (int i = 0; i < PC_NCOUNTERS; ++i) {
+        if (pc->fd[i] >= 0) {
+            ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perf_stop(PerfCount *pc)
+{
+    for (int i = 0; i < PC_NCOUNTERS; ++i) {
+        if (pc->fd[i] >= 0) {
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+void perf_read(PerfCount *pc, double v[PC_NCOUNTERS])
+{
+    for (int i = 0; i < PC_NCOUNTERS; ++i) {
+        uint64_t r[3]; // value, time enabled, time running
+        v[i] = -1;
+        if (pc->fd[i] < 0 || read(pc->fd[i], r, sizeof r) != sizeof r) {
+            continue;
+        }
+        v[i] = r[2] ? (double)r[0] * r[1] / r[2] : 0;
+    }
+}
+
+void perf_close(PerfCount *pc)
+{
+    for (int i = 0; i < PC_NCOUNTERS; ++i) {
+        if (pc->fd[i] >= 0) {
+            close(pc->fd[i]);
+        }
+        pc->fd[i] = -1;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _PERFCOUNT_H
+#define _PERFCOUNT_H
+
+#include <sys/types.h>
+
+// hardware counters through perf_event_open(2), Linux only. Counters the
+// CPU or the kernel won't give (no PMU in a VM, perf_event_paranoid) stay
+// closed and read as -1, the rest still count.
+enum {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_BRANCH_MISSES,
+    PC_L1D_MISSES,   // L1 data cache read misses
+    PC_LLC_MISSES,   // last level cache read misses
+    PC_DTLB_MISSES,  // data TLB read misses
+    PC_TASK_CLOCK,   // ns on the CPU, a software counter
+    PC_NCOUNTERS
+};
+
+typedef struct PerfCount {
+    int fd[PC_NCOUNTERS];
+} PerfCount;
+
+extern const char *perf_names[PC_NCOUNTERS];
+
+// count user space of pid, 0 for the calling thread. With on_exec the
+// counters start by themselves when pid calls exec, and follow the
+// children it makes; else perf_start starts them. Return the number of
+// counters opened.
+int perf_open(PerfCount *pc, pid_t pid, int on_exec);
+// zero and start the counters
+void perf_start(PerfCount *pc);
+void perf_stop(PerfCount *pc);
+// counts since perf_start, scaled up if the kernel multiplexed them
+void perf_read(PerfCount *pc, double v[PC_NCOUNTERS]);
+void perf_close(PerfCount *pc);
+
+#endif
@@ -1,7 +1,17 @@
 /*
- * x86 implementation of Thompson's
+ * x86-64 implementation of Thompson's
  * on-the-fly regular expression compiler.
  *
+ * As in the paper, each character of the regular expression
+ * becomes a few instructions, and a thread is the address of
+ * the code testing the character it wants next.  The threads
+ * of the current character are jumped to in turn, those that
+ * pass list their successors for the next one.  Successors are
+ * worked out at compile time, as the positions of Glushkov's
+ * automaton, and a thread already listed for a character is
+ * not listed again: a list never holds more threads than the
+ * expression has characters, and is sized to it.
+ *
  * See also Thompson, Ken.  Regular Expression Search Algorithm,
  * Communications of the ACM 11(6) (June 1968), pp. 419-422.
  * 
@@ -9,20 +19,27 @@
  * Can be distributed under the MIT license, see bottom of file.
  */
 
-#define _XOPEN_SOURCE 1000
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <stdlib.h>
 
+#ifndef __x86_64__
+#error "regexp-x86.c emits x86-64 code"
+#endif
+
 enum	{
 	LPAREN = CHAR_MAX + 1,
 	RPAREN,		/* This should	*/
 	ALTERN,		/* reflect the	*/
 	CONCAT,		/* precedence	*/
-	KLEENE		/* rules!	*/
+	KLEENE,		/* rules!	*/
+	PLUS,
+	QUEST
 };
 
 static
@@ -39,56 +56,75 @@ unsigned char *prepare(const char *src)
 	escape['r'] = '\r';
 	escape['t'] = '\t';
 	escape['v'] = '\v';
-	for (i = 0; (c = "\"()*\\|"[i]); i++)
+	for (i = 0; (c = "\"()*+?\\|"[i]); i++)
 		escape[c] = c;
 	
-	for (i = 0; (c = src[i]); i++) {
+	for (i = 0; (c = (unsigned char)src[i]); i++) {
 		
 		switch (c) {
 
 			case '(':
+				if (concat)
+					dest[j++] = CONCAT;
 				dest[j++] = LPAREN;
 				concat = 0;
 				nparen++;
 				continue;
 			case ')':
 				dest[j++] = RPAREN;
-				nparen--;
+				if (--nparen < 0)
+					goto bad;
 				break;
 			case '*':
 				dest[j++] = KLEENE;
 				break;
+			case '+':
+				dest[j++] = PLUS;
+				break;
+			case '?':
+				dest[j++] = QUEST;
+				break;
 			case '|':
 				dest[j++] = ALTERN;
 				concat = 0;
 				continue;
 			case '\\':
-				c = escape[(int)src[i + 1]];
+				c = (unsigned char)src[i + 1];
+				c = c <= CHAR_MAX ? escape[c] : 0;
 				c ? i++ : (c = '\\');
 			default:
+				if (c > CHAR_MAX)	/* would read as an operator */
+					goto bad;
 				if (concat)
 					dest[j++] = CONCAT;
 				dest[j++] = c;
 
 		}
 		concat = 1;
-		if (nparen < 0)
-			printf("unbalanced parentheses\n");
 		
 	}
+	if (nparen)
+		goto bad;
 	dest[j++] = RPAREN;
 	dest[j++] = '\0';
 
 	return	dest;
+
+bad:
+	free(dest);
+	return	NULL;
 }
 
 static
 unsigned char *convert (const char *src)
 {	/* http://cs.lasierra.edu/~ehwang/cptg454/postfix.pdf */
-	unsigned char	stack[BUFSIZ] = "";
 	unsigned char	*dest = prepare(src);
+	unsigned char	*stack;
 	int	c, i, j = 0, top = 0;
 
+	if (dest == NULL)
+		return	NULL;
+	stack = malloc(strlen((char *)dest) + 1);
 	stack[top++] = LPAREN;
 	for (i = 0; (c = dest[i]); i++) {
 
@@ -98,10 +134,15 @@ unsigned char *convert (const char *src)
 				stack[top++] = c;
 				break;
 
+			case KLEENE:
+			case PLUS:
+			case QUEST:
+				dest[j++] = c;	/* postfix already */
+				break;
+
 			case RPAREN:
 			case ALTERN:
 			case CONCAT:
-			case KLEENE:
 				while (c <= stack[top - 1])
 					dest[j++] = stack[--top];
 				if (c == RPAREN)
@@ -118,182 +159,634 @@ unsigned char *convert (const char *src)
 
 	}
 	dest[j++] = '\0';
+	free(stack);
 
 	return	dest;
 }
 
+/*
+ * Glushkov's automaton: a position for each character of the
+ * expression, the positions that can come first, and for each
+ * position those that can follow it.  Position npos stands for
+ * the end of a match.
+ */
+typedef	uint64_t	Set;
+
+#define	SETHAS(s, i)	((s)[(i) >> 6] >> ((i) & 63) & 1)
+#define	SETADD(s, i)	((s)[(i) >> 6] |= (Set)1 << ((i) & 63))
+
+typedef	struct	{
+	int	npos;
+	int	nword;		/* of a Set, npos + 1 bits */
+	unsigned char	*chr;
+	Set	**follow;
+	Set	*first;
+	int	nullable;
+}	Positions;
+
+typedef	struct	{
+	Set	*first;
+	Set	*last;
+	int	nullable;
+}	Frag;
+
 static
-void *xalloc(size_t size)
+void setor(Set *a, const Set *b, int nword)
 {
-	void	*p;
-	size_t	pagesize = sysconf(_SC_PAGESIZE);
+	int	i;
 
-	size = (size + pagesize - 1) & ~(pagesize - 1);
-	if (posix_memalign(&p, pagesize, size))
-		return	NULL;
-	mprotect(p, size, PROT_READ|PROT_WRITE|PROT_EXEC);
-	return	p;	
+	for (i = 0; i < nword; i++)
+		a[i] |= b[i];
 }
 
 static
-unsigned char header[] = {
-	0xC8, 0x94, 0x10, 0x00,				/*	enter	$400, $0		*/
-	0x8B, 0x55, 0x08,				/* 	movl	8(%ebp), %edx		*/
-	0xB8, 0xFF, 0x00, 0x00, 0x00,			/*	movl	$0xff, %eax		*/
-	0x31, 0xC9,					/* 	xorl	%ecx, %ecx		*/
-	0xE8, 0x00, 0x00, 0x00, 0x00,			/*	call	_next			*/
-							/*_next:				*/
-	0x83, 0x2C, 0x24, 0x05,				/*	sub	$5, (%esp)		*/
-	0xA8, 0xFF,					/*	test	%al			*/
-	0x75, 0x02,					/*	jnz	_L1			*/
-	0xC9,						/*	leave				*/
-	0xC3,						/*	ret				*/
-							/*_L1:					*/
-	0xE3, 0x0A,					/* 	jecxz	_L2			*/
-	0x49,						/* 	decl	%ecx			*/
-	0xFF, 0xB4, 0x8D, 0x70, 0xFE, 0xFF, 0xFF,	/* 	pushl	-400(%ebp,%ecx,4)	*/
-	0xEB, 0xF4,					/* 	jmp	_L1			*/
-							/*_L2:					*/
-	0x8A, 0x02,					/* 	movb	(%edx), %al		*/
-	0x42,						/* 	incl	%edx			*/
-	0xE8, 0x0A, 0x00, 0x00, 0x00,			/* 	call	_code			*/
-							/*_fail:				*/
-	0xC3,						/* 	ret				*/
-							/*_nnode:				*/
-	0x8F, 0x84, 0x8D, 0x70, 0xFE, 0xFF, 0xFF,	/* 	popl	-400(%ebp,%ecx,4)	*/
-	0x41,						/* 	incl	%ecx			*/
-	0xC3,						/* 	ret				*/
-};
+void addfollow(Positions *g, const Set *last, const Set *first)
+{
+	int	i;
+
+	for (i = 0; i < g->npos; i++)
+		if (SETHAS(last, i))
+			setor(g->follow[i], first, g->nword);
+}
 
 static
-unsigned char footer[] = {
-	0x4A,						/*	decl	%edx			*/
-	0x89, 0xD0,					/*	mov	%edx, %eax		*/
-	0xC9,						/*	leave				*/
-	0xC3,						/*	ret				*/
-};
+void freepositions(Positions *g)
+{
+	int	i;
 
-typedef	char *(*function_t)(char *);
+	for (i = 0; i < g->npos; i++)
+		free(g->follow[i]);
+	free(g->follow);
+	free(g->first);
+	free(g->chr);
+}
 
 static
-int codelen(const unsigned char *src)
+int positions(Positions *g, const unsigned char *post)
 {
-	int	i, c, n = 0;
+	int	i, c, n = 0, top = 0;
+	Frag	*stack, a, b;
+
+	memset(g, 0, sizeof *g);
+	for (i = 0; (c = post[i]); i++)
+		if (c <= CHAR_MAX)
+			g->npos++;
+	g->nword = (g->npos + 64) / 64;
+	g->chr = malloc(g->npos + 1);
+	g->follow = malloc((g->npos + 1) * sizeof g->follow[0]);
+	for (i = 0; i < g->npos; i++)
+		g->follow[i] = calloc(g->nword, sizeof(Set));
+	stack = malloc((strlen((char *)post) + 1) * sizeof stack[0]);
+
+	for (i = 0; (c = post[i]); i++) {
 
-	for (i = 0; (c = src[i]); i++) {
 		switch (c) {
-			default:	n += 11;	break;
-			case CONCAT:			break;
-			case KLEENE:	n +=  5;	break;
-			case ALTERN:	n +=  9;	break;
+
+			case CONCAT:
+				if (top < 2)
+					goto bad;
+				b = stack[--top];
+				a = stack[--top];
+				addfollow(g, a.last, b.first);
+				if (a.nullable)
+					setor(a.first, b.first, g->nword);
+				if (b.nullable)
+					setor(b.last, a.last, g->nword);
+				free(a.last);
+				free(b.first);
+				a.last = b.last;
+				a.nullable &= b.nullable;
+				stack[top++] = a;
+				break;
+
+			case ALTERN:
+				if (top < 2)
+					goto bad;
+				b = stack[--top];
+				a = stack[--top];
+				setor(a.first, b.first, g->nword);
+				setor(a.last, b.last, g->nword);
+				free(b.first);
+				free(b.last);
+				a.nullable |= b.nullable;
+				stack[top++] = a;
+				break;
+
+			case KLEENE:
+			case PLUS:
+			case QUEST:
+				if (top < 1)
+					goto bad;
+				if (c != QUEST)
+					addfollow(g, stack[top - 1].last, stack[top - 1].first);
+				if (c != PLUS)
+					stack[top - 1].nullable = 1;
+				break;
+
+			default:
+				a.first = calloc(g->nword, sizeof(Set));
+				a.last = calloc(g->nword, sizeof(Set));
+				SETADD(a.first, n);
+				SETADD(a.last, n);
+				a.nullable = 0;
+				g->chr[n++] = c;
+				stack[top++] = a;
+				break;
+
 		}
+
+	}
+
+	if (top > 1)
+		goto bad;
+	if (top == 0) {		/* empty expression */
+		g->first = calloc(g->nword, sizeof(Set));
+		g->nullable = 1;
+	} else {
+		for (i = 0; i < g->npos; i++)
+			if (SETHAS(stack[0].last, i))
+				SETADD(g->follow[i], g->npos);
+		g->first = stack[0].first;
+		g->nullable = stack[0].nullable;
+		free(stack[0].last);
 	}
-	return	n;
+	free(stack);
+	return	0;
+
+bad:
+	while (top > 0) {
+		free(stack[--top].first);
+		free(stack[top].last);
+	}
+	free(stack);
+	freepositions(g);
+	return	-1;
 }
 
+/*
+ * The code, for data laid out as
+ *	uint64_t	gen;
+ *	uint64_t	mark[npos];
+ *	void	*list[2][npos];
+ * Registers while it runs:
+ *	rdi	next character of the string
+ *	al	current character
+ *	rsi, r8	threads of al, cursor and end
+ *	rdx	threads of the next character, end
+ *	r9, rcx	generations of those two lists
+ *	r10	mark: position i is listed if mark[i] is the list's generation
+ *	r11	the list al's threads are in, the other one is r11 ^ swap
+ *	rbx	scratch, saved
+ * Generations keep counting from one search to the next, so
+ * no mark is ever cleared.
+ *
+ *	entry:	push	%rbx
+ *		mov	$mark, %r10
+ *		mov	$gen, %r11
+ *		mov	(%r11), %r9
+ *		inc	%r9
+ *		mov	%r9, %rcx
+ *		mov	$list0, %r11
+ *		mov	%r11, %r8
+ *	loop:	<list first positions at (%r8), generation %r9>
+ *		movzbl	(%rdi), %eax
+ *		test	%al, %al
+ *		jz	fail
+ *		inc	%rdi
+ *		mov	$swap, %rdx
+ *		xor	%r11, %rdx
+ *		mov	%r11, %rsi
+ *		lea	1(%r9), %rcx
+ *	next:	cmp	%r8, %rsi
+ *		jae	step
+ *		add	$8, %rsi
+ *		jmp	*-8(%rsi)
+ *	step:	mov	%rdx, %r8
+ *		mov	$swap, %rbx
+ *		xor	%rbx, %r11
+ *		mov	%rcx, %r9
+ *		jmp	loop
+ *	found:	mov	%rdi, %rax
+ *		jmp	save
+ *	fail:	xor	%eax, %eax
+ *	save:	mov	$gen, %r11
+ *		mov	%rcx, (%r11)
+ *		pop	%rbx
+ *		ret
+ * then for each position i
+ *	node_i:	cmp	$chr_i, %al
+ *		jne	next
+ *		<list follow_i at (%rdx), generation %rcx, or jmp found>
+ *		jmp	next
+ * where a node whose follow set an earlier node has already
+ * listed jumps to that listing instead.  Positions under a star
+ * mostly share one follow set, listing it at each of them made
+ * the code grow as the square of the expression.  What is left
+ * still can, for a?b?c?... say, and code past MAXCODE bytes is
+ * not made.
+ */
 enum	{
-	CMP	= 0x3C,
-	JNZ	= 0x75,
-	CALL	= 0xE8,
-	JMP	= 0xEB
+	MAXCODE	= 4 << 20
 };
 
-unsigned char *compile(const unsigned char *src)
+typedef	struct	{
+	unsigned char	*p;
+	size_t	n, max;
+	size_t	*fix;		/* rel32 fields to point at a node */
+	int	*fixpos;
+	size_t	nfix, maxfix;
+}	Code;
+
+#define	EMIT(c, ...)	do {				\
+		unsigned char	b_[] = { __VA_ARGS__ };	\
+		emit(c, b_, sizeof b_);			\
+	} while (0)
+
+static
+void emit(Code *c, const void *b, size_t n)
 {
-	int	i, c, pc = sizeof header, top = 0;
-	unsigned long	stack[BUFSIZ], tmp, fail = 0x31, nnode = 0x32;
-	unsigned long	length = sizeof header + codelen(src) + sizeof footer;
-	unsigned char	*code = xalloc(length);
+	if (c->n + n > c->max) {
+		c->max = 2 * (c->n + n);
+		c->p = realloc(c->p, c->max);
+	}
+	memcpy(c->p + c->n, b, n);
+	c->n += n;
+}
 
-	memmove(code, header, sizeof header);
-	for (i = 0; (c = src[i]); i++) {
+static
+void emit32(Code *c, int32_t v)
+{
+	emit(c, &v, sizeof v);
+}
 
-		switch (c) {
+static
+void emit64(Code *c, uint64_t v)
+{
+	emit(c, &v, sizeof v);
+}
 
-			default:
-				stack[top] = pc + 1;
-				code[pc + 0] = JMP;	code[pc + 1] = 0x00;
-				code[pc + 2] = CMP;	code[pc + 3] = c;
-				code[pc + 4] = JNZ;	code[pc + 5] = (fail - (pc + 6)) & 0xFF;
-				tmp = nnode - (pc + 11);
-				code[pc + 6] = CALL;	memcpy(code + pc + 7, &tmp, sizeof tmp);
-				top += 1;
-				pc += 11;
-				break;
+/* rel32 to target, for the instruction ending with it */
+static
+void rel32(Code *c, size_t target)
+{
+	emit32(c, (int32_t)(target - (c->n + 4)));
+}
 
-			case CONCAT:
-				--top;
-				break;
+static
+void patch(Code *c, size_t at, size_t target)
+{
+	int32_t	v = (int32_t)(target - (at + 4));
 
-			case KLEENE:
-				tmp = code[stack[top - 1]] + stack[top - 1] - (pc + 6);
-				code[pc + 0] = CALL;	memcpy(code + pc + 1, &tmp, sizeof tmp);
-				code[stack[top - 1]] = (pc - 1 - stack[top - 1]) & 0xFF;
-				pc += 5;
-				break;
+	memcpy(c->p + at, &v, sizeof v);
+}
 
-			case ALTERN:
-				code[pc + 0] = JMP;
-				code[pc + 1] = 0x07;
-				tmp = code[stack[top - 1]] + stack[top - 1] - (pc + 6);
-				code[pc + 2] = CALL;	memcpy(code + pc + 3, &tmp, sizeof tmp);
-				tmp = code[stack[top - 2]] + stack[top - 2] - (pc + 8);
-				code[pc + 7] = JMP;	code[pc + 8] = tmp & 0xFF;
-				code[stack[top - 2]] = (pc + 3 - stack[top - 2]) & 0xFF;
-				code[stack[top - 1]] = (pc + 8 - stack[top - 1]) & 0xFF;
-				pc += 9;
-				--top;
+static
+void fixnode(Code *c, int pos)
+{
+	if (c->nfix == c->maxfix) {
+		c->maxfix = 2 * c->maxfix + 16;
+		c->fix = realloc(c->fix, c->maxfix * sizeof c->fix[0]);
+		c->fixpos = realloc(c->fixpos, c->maxfix * sizeof c->fixpos[0]);
+	}
+	c->fix[c->nfix] = c->n;
+	c->fixpos[c->nfix++] = pos;
+	emit32(c, 0);
+}
+
+/*
+ * List the positions of s not listed yet.  The first positions
+ * go to the list being run, at %r8 with generation %r9, the
+ * others to the next one, at %rdx with generation %rcx.  Return
+ * 1 if s holds the end of a match, the code jumps to found then.
+ */
+static
+int list(Code *c, const Positions *g, const Set *s, int first, size_t found)
+{
+	unsigned char	rex = first ? 0x4D : 0x49;	/* %r9 or %rcx */
+	int	i;
+
+	if (SETHAS(s, g->npos)) {
+		EMIT(c, 0xE9);				/* jmp	found */
+		rel32(c, found);
+		return	1;
+	}
+	for (i = 0; i < g->npos; i++) {
+		if (!SETHAS(s, i))
+			continue;
+		EMIT(c, rex, 0x39, 0x8A);		/* cmp	gen, 8i(%r10) */
+		emit32(c, 8 * i);
+		EMIT(c, 0x74, 21);			/* je	1f */
+		EMIT(c, rex, 0x89, 0x8A);		/* mov	gen, 8i(%r10) */
+		emit32(c, 8 * i);
+		EMIT(c, 0x48, 0x8D, 0x1D);		/* lea	node_i(%rip), %rbx */
+		fixnode(c, i);
+		if (first)
+			EMIT(c, 0x49, 0x89, 0x18,	/* mov	%rbx, (%r8) */
+				0x49, 0x83, 0xC0, 0x08);	/* add	$8, %r8 */
+		else
+			EMIT(c, 0x48, 0x89, 0x1A,	/* mov	%rbx, (%rdx) */
+				0x48, 0x83, 0xC2, 0x08);	/* add	$8, %rdx */
+	}						/* 1: */
+	return	0;
+}
+
+/* for each position, the first one with the same follow set */
+static
+int *samefollow(const Positions *g)
+{
+	int	*same, *table, mask, i, j, k, w;
+	uint64_t	h;
+
+	for (mask = 1; mask < 2 * g->npos; mask <<= 1)
+		;
+	table = malloc(mask * sizeof table[0]);
+	memset(table, -1, mask * sizeof table[0]);
+	mask--;
+	same = malloc(g->npos * sizeof same[0]);
+	for (i = 0; i < g->npos; i++) {
+		h = 0;
+		for (w = 0; w < g->nword; w++)
+			h = (h ^ g->follow[i][w]) * 0x100000001B3ULL;
+		for (k = (h ^ h >> 32) & mask; (j = table[k]) >= 0; k = (k + 1) & mask)
+			if (memcmp(g->follow[j], g->follow[i],
+			    g->nword * sizeof(Set)) == 0)
 				break;
+		if (j < 0)
+			table[k] = j = i;
+		same[i] = j;
+	}
+	free(table);
+	return	same;
+}
 
+/* the code for g in c, or -1 if it would be larger than MAXCODE */
+static
+int compile(Code *c, const Positions *g, uint64_t *data)
+{
+	uint64_t	*gen = data, *mark = data + 1;
+	uint64_t	*list0 = mark + g->npos, *list1 = list0 + g->npos;
+	uint64_t	swap = (uintptr_t)list0 ^ (uintptr_t)list1;
+	size_t	loop, jzfail, next, jaestep, step, found, fail, *node, *listing;
+	int	i, k, *same;
+
+	memset(c, 0, sizeof *c);
+	if (g->nullable) {		/* matches right away */
+		EMIT(c, 0x48, 0x89, 0xF8,		/* mov	%rdi, %rax */
+			0xC3);				/* ret */
+		return	0;
+	}
+
+	EMIT(c, 0x53,					/* push	%rbx */
+		0x49, 0xBA);				/* mov	$mark, %r10 */
+	emit64(c, (uintptr_t)mark);
+	EMIT(c, 0x49, 0xBB);				/* mov	$gen, %r11 */
+	emit64(c, (uintptr_t)gen);
+	EMIT(c, 0x4D, 0x8B, 0x0B,			/* mov	(%r11), %r9 */
+		0x49, 0xFF, 0xC1,			/* inc	%r9 */
+		0x4C, 0x89, 0xC9,			/* mov	%r9, %rcx */
+		0x49, 0xBB);				/* mov	$list0, %r11 */
+	emit64(c, (uintptr_t)list0);
+	EMIT(c, 0x4D, 0x89, 0xD8);			/* mov	%r11, %r8 */
+
+	loop = c->n;
+	list(c, g, g->first, 1, 0);
+	EMIT(c, 0x0F, 0xB6, 0x07,			/* movzbl	(%rdi), %eax */
+		0x84, 0xC0,				/* test	%al, %al */
+		0x0F, 0x84);				/* jz	fail */
+	jzfail = c->n;
+	emit32(c, 0);
+	EMIT(c, 0x48, 0xFF, 0xC7,			/* inc	%rdi */
+		0x48, 0xBA);				/* mov	$swap, %rdx */
+	emit64(c, swap);
+	EMIT(c, 0x4C, 0x31, 0xDA,			/* xor	%r11, %rdx */
+		0x4C, 0x89, 0xDE,			/* mov	%r11, %rsi */
+		0x49, 0x8D, 0x49, 0x01);		/* lea	1(%r9), %rcx */
+
+	next = c->n;
+	EMIT(c, 0x4C, 0x39, 0xC6,			/* cmp	%r8, %rsi */
+		0x0F, 0x83);				/* jae	step */
+	jaestep = c->n;
+	emit32(c, 0);
+	EMIT(c, 0x48, 0x83, 0xC6, 0x08,			/* add	$8, %rsi */
+		0xFF, 0x66, 0xF8);			/* jmp	*-8(%rsi) */
+
+	step = c->n;
+	patch(c, jaestep, step);
+	EMIT(c, 0x49, 0x89, 0xD0,			/* mov	%rdx, %r8 */
+		0x48, 0xBB);				/* mov	$swap, %rbx */
+	emit64(c, swap);
+	EMIT(c, 0x49, 0x31, 0xDB,			/* xor	%rbx, %r11 */
+		0x49, 0x89, 0xC9,			/* mov	%rcx, %r9 */
+		0xE9);					/* jmp	loop */
+	rel32(c, loop);
+
+	found = c->n;
+	EMIT(c, 0x48, 0x89, 0xF8,			/* mov	%rdi, %rax */
+		0xEB, 0x02);				/* jmp	save */
+	fail = c->n;
+	patch(c, jzfail, fail);
+	EMIT(c, 0x31, 0xC0,				/* xor	%eax, %eax */
+		0x49, 0xBB);				/* save: mov	$gen, %r11 */
+	emit64(c, (uintptr_t)gen);
+	EMIT(c, 0x49, 0x89, 0x0B,			/* mov	%rcx, (%r11) */
+		0x5B,					/* pop	%rbx */
+		0xC3);					/* ret */
+
+	node = malloc(g->npos * sizeof node[0]);
+	listing = malloc(g->npos * sizeof listing[0]);
+	same = samefollow(g);
+	for (i = 0; i < g->npos && c->n <= MAXCODE; i++) {
+		node[i] = c->n;
+		EMIT(c, 0x3C, g->chr[i],		/* cmp	$chr_i, %al */
+			0x0F, 0x85);			/* jne	next */
+		rel32(c, next);
+		if (same[i] < i) {
+			EMIT(c, 0xE9);			/* jmp	listing_same */
+			rel32(c, listing[same[i]]);
+			continue;
+		}
+		listing[i] = c->n;
+		if (!list(c, g, g->follow[i], 0, found)) {
+			EMIT(c, 0xE9);			/* jmp	next */
+			rel32(c, next);
 		}
+	}
+	for (k = 0; i == g->npos && k < c->nfix; k++)
+		patch(c, c->fix[k], node[c->fixpos[k]]);
+	free(same);
+	free(listing);
+	free(node);
+	free(c->fix);
+	free(c->fixpos);
+	if (c->n > MAXCODE) {
+		free(c->p);
+		return	-1;
+	}
+	return	0;
+}
+
+/*
+ * Executable memory is never writable as well.  Code is made
+ * in malloc'd memory, copied into whole pages while they are
+ * read-write, and only then are they made read-execute.  The
+ * pages of a program let go go back, read-write again, to the
+ * pool the next programs are copied into.
+ */
+typedef	struct	Pages	Pages;
+struct	Pages {
+	unsigned char	*p;
+	size_t	n;
+	Pages	*next;
+};
 
+enum	{
+	CHUNK	= 64		/* pages mapped at once */
+};
+
+static	Pages	*freepages;
+static	size_t	pagesize;
+
+static
+void pagefree(unsigned char *p, size_t n)
+{
+	Pages	*f;
+
+	/* pages that cannot be written again are no use to the pool */
+	if (mprotect(p, n * pagesize, PROT_READ|PROT_WRITE) < 0) {
+		munmap(p, n * pagesize);
+		return;
 	}
-	memmove(code + pc, footer, sizeof footer);
+	f = malloc(sizeof *f);
+	f->p = p;
+	f->n = n;
+	f->next = freepages;
+	freepages = f;
+}
 
-	return	code;
+static
+unsigned char *pagealloc(size_t n)
+{
+	Pages	**l, *f;
+	unsigned char	*p;
+	size_t	m;
+
+	for (l = &freepages; (f = *l); l = &f->next) {
+		if (f->n < n)
+			continue;
+		p = f->p;
+		f->p += n * pagesize;
+		if ((f->n -= n) == 0) {
+			*l = f->next;
+			free(f);
+		}
+		return	p;
+	}
+	m = n > CHUNK ? n : CHUNK;
+	p = mmap(NULL, m * pagesize, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return	NULL;
+	if (m > n)
+		pagefree(p + n * pagesize, m - n);
+	return	p;
 }
 
+/*
+ * the program for search, returns where its match ends or NULL.
+ * Its lists are kept with it: one search at a time.
+ */
+typedef	char *(*function_t)(char *);
+
+typedef	struct	Program	Program;
+struct	Program {
+	unsigned char	*code;
+	size_t	npages;
+	uint64_t	*data;
+	Program	*next;
+};
+
+static	Program	*programs;
+
 function_t study(const char *re)
 {
 	unsigned char	*p = convert(re);
-	unsigned char	*q = compile(p);
+	Positions	g;
+	Program	*prog;
+	Code	c;
 
-	if (p) free (p), p = NULL;
-	return	(function_t)q;
+	if (p == NULL)
+		return	NULL;
+	if (positions(&g, p) < 0) {
+		free(p);
+		return	NULL;
+	}
+	free(p);
+
+	if (pagesize == 0)
+		pagesize = sysconf(_SC_PAGESIZE);
+	prog = malloc(sizeof *prog);
+	prog->data = calloc(1 + 3 * (size_t)g.npos, sizeof prog->data[0]);
+	if (compile(&c, &g, prog->data) < 0) {
+		freepositions(&g);
+		free(prog->data);
+		free(prog);
+		return	NULL;
+	}
+	freepositions(&g);
+	prog->npages = (c.n + pagesize - 1) / pagesize;
+	prog->code = pagealloc(prog->npages);
+	if (prog->code == NULL) {
+		free(c.p);
+		free(prog->data);
+		free(prog);
+		return	NULL;
+	}
+	memcpy(prog->code, c.p, c.n);
+	free(c.p);
+	if (mprotect(prog->code, prog->npages * pagesize, PROT_READ|PROT_EXEC) < 0) {
+		pagefree(prog->code, prog->npages);
+		free(prog->data);
+		free(prog);
+		return	NULL;
+	}
+	prog->next = programs;
+	programs = prog;
+
+	return	(function_t)prog->code;
+}
+
+void unstudy(function_t search)
+{
+	Program	**l, *prog;
+
+	for (l = &programs; (prog = *l); l = &prog->next)
+		if ((function_t)prog->code == search) {
+			*l = prog->next;
+			pagefree(prog->code, prog->npages);
+			free(prog->data);
+			free(prog);
+			return;
+		}
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
-	short	i;
-	struct	{
-		char	*r;
-		char	*s;
-	} test[] = {
-		/*
-		{ "abcdefg",	"abcdefg"	},
-		{ "(a|b)*a",	"ababababab"	},
-		{ "(a|b)*a",	"aaaaaaaaba"	},
-		{ "(a|b)*a",	"aaaaaabac"	},
-		{ "a(b|c)*d",	"abccbcccd"	},
-		{ "a(b|c)*d",	"abccbcccde"	},
-		*/
-		{ "a(b|c)*d",	"abcccccccc"	},
-		/*
-		{ "a(b|c)*d",	"abcd"		},
-		*/
-		{ NULL,		NULL		}
-	};
-
-	for (i = 0; test[i].r; i++) {
-		function_t search = study(test[i].r);
-		char	*t;
-
-		printf("search %s %s\n", test[i].r, test[i].s);
-		t = (*search)(test[i].s);
-		if (t)	printf("match found after %d bytes\n", t - test[i].s);
-		else	printf("match not found\n");
-		free((void *)search);
+	function_t	search;
+	int	i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: regexp-x86 regexp string...\n");
+		return	1;
+	}
+	search = study(argv[1]);
+	if (search == NULL) {
+		fprintf(stderr, "bad regexp %s\n", argv[1]);
+		return	1;
 	}
+	for (i = 2; i < argc; i++)
+		if ((*search)(argv[i]))
+			printf("%s\n", argv[i]);
+	unstudy(search);
 
 	return	0;
 }
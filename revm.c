@@ -17,6 +17,7 @@ static inline void debug(const char *fmt, ...)
 #endif
 }
 
+#ifdef DEBUG
 //Ast Types
 static char *typeNames[] = {
     "(NULL)",
@@ -62,7 +63,6 @@ static void dumpast(ReAst *root, int deep)
     dumpast(root->rhs, deep+1);
 }
 
-
 static void dumpinst(Re *re, Inst *i)
 {
     static char *instNames[] = {
@@ -96,14 +96,14 @@ static void dumpinst(Re *re, Inst *i)
 
 }
 
-static void dumpsub(Re *re, Sub sub[NPAREN])
+static void dumpsub(ReCtx *ctx, Sub sub[NPAREN])
 {
-    char buf[128];
+    char buf[NPAREN * 48];
     int len = 0;
     for (int i = 0; i < NPAREN; i++) {
         if (sub[i*2].sp && sub[i*2+1].sp) {
-            len += sprintf(buf+len, "(%ld, %ld)", sub[i*2].sp - re->s,
-                           sub[i*2+1].sp - re->s);
+            len += sprintf(buf+len, "(%ld, %ld)", sub[i*2].sp - ctx->s,
+                           sub[i*2+1].sp - ctx->s);
         } else {
             len += sprintf(buf+len, "(?, ?)");
         }
@@ -120,6 +120,8 @@ static void dumpinsts(Re *re)
     }
 }
 
+// for the calls commented out in exec_switch
+__attribute__((unused))
 static void dumpthreads(const char *msg, Re *re, ThreadList *tl)
 {
     fprintf(stderr, "%s", msg);
@@ -127,6 +129,7 @@ static void dumpthreads(const char *msg, Re *re, ThreadList *tl)
         dumpinst(re, tl->threads[i].pc);
     }
 }
+#endif
 
 void *pmalloc(size_t size)
 {
@@ -156,7 +159,6 @@ static Inst *re_addInst(Re *re, int op, int c, Inst *br1, Inst *br2)
     Inst *i = &re->insts[re->size++];
     i->op = op;
     i->c = c;
-    i->gen = 0;
     i->br1 = br1;
     i->br2 = br2;
     return i;
@@ -234,6 +236,9 @@ static Inst *re_compile(Re *re, ReAst *ast)
     }
 
     case Paren: {
+        if (ast->c >= NPAREN) { // no room in Sub, group only
+            return re_compile(re, ast->lhs);
+        }
         Inst *i = re_addInst(re, ISave, 2*ast->c, NULL, NULL);
         re_compile(re, ast->lhs);
         re_addInst(re, ISave, 2*ast->c + 1, NULL, NULL);
@@ -246,6 +251,11 @@ static Inst *re_compile(Re *re, ReAst *ast)
     };
 }
 
+void re_set_backtrack_bits(Re *re, size_t bits)
+{
+    re->backtrack_bits = bits;
+}
+
 void re_setopt(Re *re, int opt)
 {
     re->opts |= opt;
@@ -287,15 +297,25 @@ static int visit_ast(ReAst *ast, int (*fn)(ReAst*))
     return val;
 }
 
+// GCC and clang take the address of a label, the interpreter can then jump
+// straight to the code of the next op
+#ifdef __GNUC__
+#define RE_THREADED
+static int exec_threaded(ReCtx *ctx, Re *re, char *s);
+#endif
+
+static OnePass *onepass_new(Re *re);
+
 //FIXME: global var, no good
 extern char *input;
 Re *re_new(const char *rep, int opts)
 {
     Re *re = malloc(sizeof(Re));
-    bzero(re, sizeof re);
+    bzero(re, sizeof *re);
 
     input = (char *)rep;
     re_setopt(re, opts);
+    re->backtrack_bits = RE_BACKTRACK_BITS;
 
     yyparse(re);
 
@@ -305,7 +325,9 @@ Re *re_new(const char *rep, int opts)
         ast->nongreedy = 1;
         re->ast = ast_new(Concat, 0, ast, re->ast);
     }
+#ifdef DEBUG
     dumpast(re->ast, 0);
+#endif
 
     int nr_insts = visit_ast(re->ast, collect_insts) + 1; // plus 1 for IMatch
     debug("insts size: %d\n", nr_insts);
@@ -314,97 +336,201 @@ Re *re_new(const char *rep, int opts)
     re_compile(re, re->ast);
     re_addInst(re, IMatch, 0, NULL, NULL);
 
+#ifdef DEBUG
     dumpinsts(re);
+#endif
+#ifdef RE_THREADED
+    exec_threaded(NULL, re, NULL);
+#endif
+    re->onepass = onepass_new(re);
+    debug("one-pass: %s\n", re->onepass ? "yes" : "no");
 
+    re->ctx = re_ctx_new(re);
     return re;
 }
 
+ReCtx *re_ctx_new(Re *re)
+{
+    ReCtx *ctx = pmalloc(sizeof(ReCtx));
+    bzero(ctx, sizeof *ctx);
+    ctx->re = re;
+    ctx->gen = calloc(re->size, sizeof(int));
+    ctx->capacity = re->size;
+    ctx->tpool[0].threads = pmalloc(sizeof(Thread) * ctx->capacity);
+    ctx->tpool[1].threads = pmalloc(sizeof(Thread) * ctx->capacity);
+    ctx->stack = pmalloc(sizeof(AddFrame) * re->size);
+    return ctx;
+}
+
+void re_ctx_free(ReCtx *ctx)
+{
+    // every Caps is back in the pool once an exec is over
+    while (ctx->capfree) {
+        Caps *c = ctx->capfree;
+        ctx->capfree = c->next;
+        free(c);
+    }
+    free(ctx->back);
+    free(ctx->visited);
+    free(ctx->stack);
+    free(ctx->tpool[0].threads);
+    free(ctx->tpool[1].threads);
+    free(ctx->gen);
+    free(ctx);
+}
+
 #define swap_list(tl1, tl2) do {                \
         ThreadList *tmp = tl1;                  \
         tl1 = tl2;                              \
         tl2 = tmp;                              \
     } while(0)
 
-static void addthread(Re *re, ThreadList *tl, Inst *pc, Sub *sub, char *sp)
+static Caps *caps_new(ReCtx *ctx)
 {
-    //FIXME: need O(1) search
-    if (pc->gen == re->gen) {
+    Caps *c = ctx->capfree;
+    if (c) {
+        ctx->capfree = c->next;
+    } else {
+        c = pmalloc(sizeof(Caps));
+    }
+    c->ref = 1;
+    return c;
+}
+
+static void caps_put(ReCtx *ctx, Caps *c)
+{
+    if (--c->ref == 0) {
+        c->next = ctx->capfree;
+        ctx->capfree = c;
+    }
+}
+
+// set capture i of one reference of c, on a copy if other threads hold c
+static Caps *caps_set(ReCtx *ctx, Caps *c, int i, char *sp)
+{
+    if (c->ref > 1) {
+        Caps *copy = caps_new(ctx);
+        memcpy(copy->sub, c->sub, sizeof copy->sub);
+        c->ref--;
+        c = copy;
+    }
+    c->sub[i].sp = sp;
+    return c;
+}
+
+// add the threads pc leads to, giving them the reference of caps
+static void addthread(ReCtx *ctx, ThreadList *tl, Inst *pc, Caps *caps, char *sp)
+{
+    Re *re = ctx->re;
+    int *gen = &ctx->gen[pc - re->insts];
+    if (*gen == ctx->curgen) {
         /* debug("["); */
         /* dumpinst(re, pc); */
         /* debug("] already in thread\n"); */
+        caps_put(ctx, caps);
         return;
     }
-    pc->gen = re->gen;
+    *gen = ctx->curgen;
 
     //recursive adding respects thread priority(greedy or not changes priority)
     switch(pc->op) {
     case ISplit:
-        addthread(re, tl, pc->br1, sub, sp);
-        addthread(re, tl, pc->br2, sub, sp);
+        caps->ref++;
+        addthread(ctx, tl, pc->br1, caps, sp);
+        addthread(ctx, tl, pc->br2, caps, sp);
         break;
 
     case IJmp:
-        addthread(re, tl, pc->br1, sub, sp);
+        addthread(ctx, tl, pc->br1, caps, sp);
         break;
 
-    case ISave: {
-        //FIXME: mem leak
-        Sub *newsub = malloc(sizeof re->sub);
-        memcpy(newsub, sub, sizeof re->sub);
-        newsub[pc->c].sp = sp;
+    case ISave:
         /* debug("saving: %ld at %d\n", sp - re->s, pc->c); */
-        addthread(re, tl, pc+1, newsub, sp);
+        addthread(ctx, tl, pc+1, caps_set(ctx, caps, pc->c, sp), sp);
         break;
-    }
 
     default:
         tl->threads[tl->n].pc = pc;
-        memcpy(tl->threads[tl->n++].sub, sub, sizeof re->sub);
+        tl->threads[tl->n++].caps = caps;
         break;
     }
 }
 
-int re_exec(Re *re, char *s)
+// a match at thread i of tl: its captures are the match's, and threads
+// after it have lower priorities, they are cut off
+static void matched(ReCtx *ctx, ThreadList *tl, int i)
+{
+    memcpy(ctx->sub, tl->threads[i].caps->sub, sizeof ctx->sub);
+    ctx->matched++;
+    for (int j = i; j < tl->n; j++) {
+        caps_put(ctx, tl->threads[j].caps);
+    }
+    tl->n = i;
+}
+
+// the captures of nothing matched yet
+static Caps *caps_start(ReCtx *ctx)
+{
+    Caps *caps = caps_new(ctx);
+    bzero(caps->sub, sizeof caps->sub);
+    return caps;
+}
+
+// the captures of the match found, if any, and whether it counts
+static int exec_done(ReCtx *ctx, char *s)
+{
+    int done = ctx->matched > 0;
+#ifdef DEBUG
+    dumpsub(ctx, ctx->sub);
+#endif
+    if (re_getopt(ctx->re, RE_ANCHOR_TAIL)) {
+        done = done && (ctx->sub[1].sp == s);
+    }
+
+    return done;
+}
+
+static int exec_switch(ReCtx *ctx, char *s)
 {
-    re->s = s;
-    re->capacity = re->size;
-    re->tpool[0].threads = malloc(sizeof(Thread) * re->capacity);
-    re->tpool[1].threads = malloc(sizeof(Thread) * re->capacity);
-    bzero(re->tpool[0].threads, sizeof re->tpool[0].threads);
-    bzero(re->tpool[1].threads, sizeof re->tpool[1].threads);
+    Re *re = ctx->re;
+    ctx->s = s;
+    ctx->matched = 0;
+    bzero(ctx->sub, sizeof ctx->sub);
 
-    re->gen = 1;
-    ThreadList *cl = &re->tpool[0], *nl = &re->tpool[1];
-    addthread(re, cl, &re->insts[0], re->sub, (char *)s);
+    // generations only grow, marks left by earlier calls are all stale
+    ctx->curgen++;
+    ThreadList *cl = &ctx->tpool[0], *nl = &ctx->tpool[1];
+    cl->n = 0;
+    addthread(ctx, cl, &re->insts[0], caps_start(ctx), (char *)s);
 
     for (;;s++) {
         /* debug("*s: %c\n", *s); */
         /* dumpthreads("cl:\n", re, cl); */
-        re->gen++;
+        ctx->curgen++;
         nl->n = 0;
         for (int i = 0; i < cl->n; i++) {
             Thread t = cl->threads[i];
             Inst *pc = t.pc;
             switch(pc->op) {
             case IChar:
-                if (pc->c != *s) {
+                if (pc->c != (unsigned char)*s) {
+                    caps_put(ctx, t.caps);
                     continue;
                 }
-                addthread(re, nl, pc+1, t.sub, (char*)s+1);
+                addthread(ctx, nl, pc+1, t.caps, (char*)s+1);
                 break;
 
             case IAny:
                 if (*s == '\0') {
+                    caps_put(ctx, t.caps);
                     break;
                 }
 
-                addthread(re, nl, pc+1, t.sub, (char*)s+1);
+                addthread(ctx, nl, pc+1, t.caps, (char*)s+1);
                 break;
 
             case IMatch:
-                memcpy(re->sub, t.sub, sizeof re->sub);
-                re->matched++;
-                cl->n = i; // cut off threads with low priorities
+                matched(ctx, cl, i);
                 break;
             }
         }
@@ -416,12 +542,459 @@ int re_exec(Re *re, char *s)
         }
     }
 
-    int done = re->matched > 0;
-    dumpsub(re, re->sub);
+    return exec_done(ctx, s);
+}
+
+#ifdef RE_THREADED
+// exec_switch as threaded code: every Inst holds the address of its
+// handlers, here. addthread is a loop over an explicit stack instead of a
+// recursion, its caller's label in ret, and each pending branch holds a
+// reference of its captures. With a NULL ctx, fill in the handlers of re
+// instead of matching.
+static int exec_threaded(ReCtx *ctx, Re *re, char *s)
+{
+    static const void *const adds[] = {
+        [IChar] = &&add_thread,
+        [IAny] = &&add_thread,
+        [IMatch] = &&add_thread,
+        [ISplit] = &&add_split,
+        [IJmp] = &&add_jmp,
+        [ISave] = &&add_save,
+    };
+    static const void *const steps[] = {
+        [IChar] = &&step_char,
+        [IAny] = &&step_any,
+        [IMatch] = &&step_match,
+        [ISplit] = &&step_next, // added through, never in a list
+        [IJmp] = &&step_next,
+        [ISave] = &&step_next,
+    };
+
+    if (!ctx) {
+        for (int i = 0; i < re->size; ++i) {
+            re->insts[i].add = adds[re->insts[i].op];
+            re->insts[i].step = steps[re->insts[i].op];
+        }
+        return 0;
+    }
+
+    ThreadList *cl = &ctx->tpool[0], *nl = &ctx->tpool[1], *tl;
+    AddFrame *stack = ctx->stack;
+    Thread *t = NULL;
+    Inst *pc;
+    Caps *caps;
+    char *sp;
+    const void *ret;
+    int i = 0, top;
+
+    ctx->s = s;
+    ctx->matched = 0;
+    bzero(ctx->sub, sizeof ctx->sub);
+
+    ctx->curgen++;
+    cl->n = 0;
+    tl = cl;
+    pc = &re->insts[0];
+    caps = caps_start(ctx);
+    sp = s;
+    ret = &&started;
+    goto add;
+started:
+
+    for (;; s++) {
+        ctx->curgen++;
+        nl->n = 0;
+        for (i = 0; i < cl->n; i++) {
+            t = &cl->threads[i];
+            goto *t->pc->step;
+
+        step_char:
+            if (t->pc->c != (unsigned char)*s) {
+                caps_put(ctx, t->caps);
+                continue;
+            }
+            goto step_add;
+
+        step_any:
+            if (*s == '\0') {
+                caps_put(ctx, t->caps);
+                continue;
+            }
+
+        step_add:
+            tl = nl;
+            pc = t->pc + 1;
+            caps = t->caps;
+            sp = s + 1;
+            ret = &&step_next;
+            goto add;
+
+        step_match:
+            matched(ctx, cl, i);
+
+        step_next:
+            ;
+        }
+
+        swap_list(cl, nl);
+        if (*s == '\0') {
+            break;
+        }
+    }
+
+    return exec_done(ctx, s);
+
+    // addthread(ctx, tl, pc, caps, sp), then goto *ret
+add:
+    top = 0;
+add_inst:
+    if (ctx->gen[pc - re->insts] == ctx->curgen) {
+        caps_put(ctx, caps);
+        goto add_pop;
+    }
+    ctx->gen[pc - re->insts] = ctx->curgen;
+    goto *pc->add;
+
+add_split:
+    caps->ref++;
+    stack[top++] = (AddFrame){ pc->br2, caps };
+    pc = pc->br1;
+    goto add_inst;
+
+add_jmp:
+    pc = pc->br1;
+    goto add_inst;
+
+add_save:
+    caps = caps_set(ctx, caps, pc->c, sp);
+    pc++;
+    goto add_inst;
+
+add_thread:
+    tl->threads[tl->n].pc = pc;
+    tl->threads[tl->n++].caps = caps;
+
+add_pop:
+    if (top == 0) {
+        goto *ret;
+    }
+    top--;
+    pc = stack[top].pc;
+    caps = stack[top].caps;
+    goto add_inst;
+}
+#endif
+
+// at most this many states, 2KB each, for a one-pass program
+#define RE_ONEPASS_MAX_STATES 1024
+
+// the closure of a one-pass state being built, in the order addthread
+// would add its threads
+typedef struct OnePassBuild_ {
+    Re *re;
+    OnePass *op;
+    int *state;  // state of the closure after each IChar and IAny
+    char *seen;  // Insts already in the closure
+    OnePassState *st;
+    int ok;      // no two threads on one byte so far
+} OnePassBuild;
+
+static void onepass_closure(OnePassBuild *b, Inst *pc, uint32_t saves)
+{
+    OnePassState *st = b->st;
+    if (!b->ok || st->match || b->seen[pc - b->re->insts]) {
+        return;
+    }
+    b->seen[pc - b->re->insts] = 1;
+
+    switch(pc->op) {
+    case ISplit:
+        onepass_closure(b, pc->br1, saves);
+        onepass_closure(b, pc->br2, saves);
+        break;
+
+    case IJmp:
+        onepass_closure(b, pc->br1, saves);
+        break;
+
+    case ISave:
+        onepass_closure(b, pc+1, saves | 1u << pc->c);
+        break;
+
+    case IMatch:
+        st->match = 1;
+        st->match_saves = saves;
+        break;
+
+    case IChar:
+    case IAny: {
+        int lo = pc->op == IChar ? pc->c : 1, hi = pc->op == IChar ? pc->c : 255;
+        for (int c = lo; c <= hi; c++) {
+            if (st->next[c].next) {
+                b->ok = 0;
+                return;
+            }
+            st->next[c].next = &b->op->states[b->state[pc - b->re->insts]];
+            st->next[c].saves = saves;
+        }
+        break;
+    }
+    }
+}
+
+// the tables of a one-pass re, or NULL if it isn't one
+static OnePass *onepass_new(Re *re)
+{
+    OnePassBuild b = { re, NULL, NULL, NULL, NULL, 1 };
+    int nstates = 1;
+    b.state = pmalloc(sizeof(int) * re->size);
+    for (int i = 0; i < re->size; i++) {
+        int op = re->insts[i].op;
+        b.state[i] = op == IChar || op == IAny ? nstates++ : -1;
+    }
+    if (nstates > RE_ONEPASS_MAX_STATES) {
+        free(b.state);
+        return NULL;
+    }
+
+    OnePass *op = pmalloc(sizeof(OnePass));
+    op->nstates = nstates;
+    op->states = pmalloc(sizeof(OnePassState) * nstates);
+    b.op = op;
+    b.seen = pmalloc(re->size);
+    for (int i = 0; i < nstates; i++) {
+        OnePassState *st = &op->states[i];
+        st->match = 0;
+        st->match_saves = 0;
+        for (int c = 0; c < 256; c++) {
+            st->next[c].next = NULL;
+            st->next[c].saves = 0;
+        }
+    }
+    b.st = &op->states[0];
+    bzero(b.seen, re->size);
+    onepass_closure(&b, &re->insts[0], 0);
+    for (int i = 0; i < re->size && b.ok; i++) {
+        if (b.state[i] >= 0) {
+            b.st = &op->states[b.state[i]];
+            bzero(b.seen, re->size);
+            onepass_closure(&b, &re->insts[i+1], 0);
+        }
+    }
+
+    free(b.seen);
+    free(b.state);
+    if (!b.ok) {
+        free(op->states);
+        free(op);
+        return NULL;
+    }
+    return op;
+}
+
+static void set_saves(Sub *sub, uint32_t saves, char *sp)
+{
+    for (int i = 0; saves; i++, saves >>= 1) {
+        if (saves & 1) {
+            sub[i].sp = sp;
+        }
+    }
+}
+
+// the match of state st at sp, with the captures sub had then
+static void onepass_matched(ReCtx *ctx, Sub *sub, OnePassState *st, char *sp)
+{
+    memcpy(ctx->sub, sub, sizeof ctx->sub);
+    set_saves(ctx->sub, st->match_saves, sp);
+    ctx->matched++;
+}
+
+// what the Pike VM finds, with its one thread: a table lookup for each
+// byte, and the captures in a single array. A match is only copied out
+// before a save changes the captures, or at the end, not at every byte.
+static int exec_onepass(ReCtx *ctx, char *s)
+{
+    Re *re = ctx->re;
+    OnePassState *st = &re->onepass->states[0], *mst = NULL;
+    Sub sub[2*NPAREN];
+    char *msp = NULL;
+
+    ctx->s = s;
+    ctx->matched = 0;
+    bzero(ctx->sub, sizeof ctx->sub);
+    bzero(sub, sizeof sub);
+
+    for (;; s++) {
+        if (st->match) {
+            mst = st;
+            msp = s;
+        }
+        OnePassNext *next = &st->next[(unsigned char)*s];
+        if (!next->next) {
+            break;
+        }
+        if (next->saves) {
+            if (mst) {
+                onepass_matched(ctx, sub, mst, msp);
+                mst = NULL;
+            }
+            set_saves(sub, next->saves, s);
+        }
+        st = next->next;
+    }
+    if (mst) {
+        onepass_matched(ctx, sub, mst, msp);
+    }
+
+    // the Pike VM would have gone on to the end before checking the tail
     if (re_getopt(re, RE_ANCHOR_TAIL)) {
-        done = done && (re->sub[1].sp == s);
+        s += strlen(s);
+    }
+    return exec_done(ctx, s);
+}
+
+static void *prealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("realloc");
+        exit(errno);
     }
 
+    return p;
+}
+
+static BackFrame *back_grow(ReCtx *ctx)
+{
+    ctx->nback = ctx->nback ? 2 * ctx->nback : 64;
+    ctx->back = prealloc(ctx->back, sizeof(BackFrame) * ctx->nback);
+    return ctx->back;
+}
+
+// what the Pike VM finds, by trying the branches of each ISplit in order:
+// the first IMatch reached is the one of the highest priority. An Inst is
+// run at most once at each offset of the len bytes of s, a second time
+// would fail the same way, so it takes O(size * len) as the Pike VM does.
+static int exec_backtrack(ReCtx *ctx, char *s, size_t len)
+{
+    Re *re = ctx->re;
+    size_t nwords = (re->size * (len + 1) + 31) / 32, top = 0;
+    uint32_t *visited;
+    BackFrame *back = ctx->back;
+    Sub sub[2*NPAREN];
+
+    if (nwords > ctx->nvisited) {
+        ctx->visited = prealloc(ctx->visited, sizeof(uint32_t) * nwords);
+        ctx->nvisited = nwords;
+    }
+    visited = ctx->visited;
+    bzero(visited, sizeof(uint32_t) * nwords);
+
+    ctx->s = s;
+    ctx->matched = 0;
+    bzero(ctx->sub, sizeof ctx->sub);
+    bzero(sub, sizeof sub);
+
+#define BACK_PUSH(pc_, sp_, restore_) do {                      \
+        if (top == ctx->nback) {                                \
+            back = back_grow(ctx);                              \
+        }                                                       \
+        back[top++] = (BackFrame){ pc_, sp_, restore_ };        \
+    } while (0)
+
+    BACK_PUSH(&re->insts[0], s, 0);
+    while (top > 0) {
+        BackFrame *f = &back[--top];
+        Inst *pc = f->pc;
+        char *sp = f->sp;
+        if (f->restore) {
+            sub[pc->c].sp = sp;
+            continue;
+        }
+
+        // the bits of an offset are together, base is the first of sp's
+        size_t base = (sp - s) * re->size;
+        for (;;) {
+            size_t bit = base + (pc - re->insts);
+            if (visited[bit / 32] & 1u << bit % 32) {
+                break;
+            }
+            visited[bit / 32] |= 1u << bit % 32;
+
+            switch(pc->op) {
+            case IChar:
+                if (pc->c != (unsigned char)*sp) {
+                    goto fail;
+                }
+                pc++;
+                sp++;
+                base += re->size;
+                continue;
+
+            case IAny:
+                if (*sp == '\0') {
+                    goto fail;
+                }
+                pc++;
+                sp++;
+                base += re->size;
+                continue;
+
+            case ISplit:
+                BACK_PUSH(pc->br2, sp, 0);
+                pc = pc->br1;
+                continue;
+
+            case IJmp:
+                pc = pc->br1;
+                continue;
+
+            case ISave:
+                BACK_PUSH(pc, sub[pc->c].sp, 1);
+                sub[pc->c].sp = sp;
+                pc++;
+                continue;
+
+            case IMatch:
+                memcpy(ctx->sub, sub, sizeof ctx->sub);
+                ctx->matched++;
+                return exec_done(ctx, s + len);
+            }
+        }
+    fail:
+        ;
+    }
+#undef BACK_PUSH
+
+    return exec_done(ctx, s + len);
+}
+
+int re_ctx_exec(ReCtx *ctx, char *s)
+{
+    Re *re = ctx->re;
+    if (!re_getopt(re, RE_PIKE)) {
+        if (re->onepass) {
+            return exec_onepass(ctx, s);
+        }
+        // s may be long, only look as far as the bitmap would reach
+        size_t max = re->backtrack_bits / re->size;
+        size_t len = max > 0 ? strnlen(s, max) : 0;
+        if (len < max) {
+            return exec_backtrack(ctx, s, len);
+        }
+    }
+#ifdef RE_THREADED
+    if (!re_getopt(ctx->re, RE_SWITCH)) {
+        return exec_threaded(ctx, ctx->re, s);
+    }
+#endif
+    return exec_switch(ctx, s);
+}
+
+int re_exec(Re *re, char *s)
+{
+    int done = re_ctx_exec(re->ctx, s);
+    memcpy(re->sub, re->ctx->sub, sizeof re->sub);
     return done;
 }
 
@@ -438,8 +1011,11 @@ static void free_ast(ReAst *ast)
 
 void re_free(Re *re)
 {
-    free(re->tpool[0].threads);
-    free(re->tpool[1].threads);
+    re_ctx_free(re->ctx);
+    if (re->onepass) {
+        free(re->onepass->states);
+        free(re->onepass);
+    }
     free(re->insts);
     free_ast(re->ast);
     free(re);
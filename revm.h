@@ -2,6 +2,7 @@
  * VM for RE: http://swtch.com/~rsc/regexp/regexp2.html
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,18 +45,29 @@ typedef struct Sub_ {
 
 #define NPAREN 10
 
+// captures of the threads that agree on all of them, copied only when one
+// thread changes a capture the others still hold
+typedef struct Caps_ {
+    int ref;
+    struct Caps_ *next; // link of the free ones
+    Sub sub[2*NPAREN];
+} Caps;
+
 typedef struct Thread_ Thread;
 typedef struct Inst_ {
     int op;
     int c;
-    int gen;
     struct Inst_ *br1;
     struct Inst_ *br2;
+
+    // threaded code: where the interpreter goes for op, set by re_new
+    const void *add;  // adding a thread at this Inst
+    const void *step; // running a thread that waits here
 } Inst;
 
 struct Thread_ {
     Inst *pc;
-    Sub sub[2*NPAREN];
+    Caps *caps; // one reference of it
 };
 
 typedef struct ThreadList_ {
@@ -66,29 +78,93 @@ typedef struct ThreadList_ {
 enum {
     RE_ANCHOR_HEAD = 0x01,
     RE_ANCHOR_TAIL = 0x02,
+    RE_SWITCH = 0x04, // dispatch on op through a switch, not threaded code
+    RE_PIKE = 0x08,   // the Pike VM, never the one-pass or backtracking ones
 };
 
+// bits of (Inst, offset) visited the backtracker may use: it runs instead
+// of the Pike VM when size * (strlen + 1) fits
+#define RE_BACKTRACK_BITS (256 * 1024)
+
+typedef struct OnePassState_ OnePassState;
+
+// a byte the closure of a one-pass state goes on with
+typedef struct OnePassNext_ {
+    OnePassState *next; // state after the byte, NULL if no thread takes it
+    uint32_t saves;     // captures set to the position of the byte, a bit each
+} OnePassNext;
+
+// the closure of the start, or of the Inst after an IChar or IAny
+struct OnePassState_ {
+    int match;            // whether the IMatch is in it
+    uint32_t match_saves; // captures set on the way to the IMatch
+    OnePassNext next[256];
+};
+
+// a program where at most one thread goes on with each byte: the threads
+// of a closure wait on different bytes, those after an IMatch are cut off
+typedef struct OnePass_ {
+    int nstates;
+    OnePassState *states; // the start first
+} OnePass;
+
 typedef struct Re_ {
     Inst *insts;
     int size;
-    Sub sub[2*NPAREN];
-    char *s;
-    int matched;  // flag that some of threads match
+    Sub sub[2*NPAREN]; // captures of the last re_exec
 
     int opts;
 
-    //private, move it
-    int capacity; // max threads
-    ThreadList tpool[2];
     ReAst *ast;
-    int gen; // generation of threadlist
+    struct ReCtx_ *ctx; // used by re_exec
+    OnePass *onepass;   // NULL unless the program is one-pass
+    size_t backtrack_bits; // RE_BACKTRACK_BITS unless set, 0 for none
 } Re;
 
+// a branch the threaded interpreter is to add threads from later, with
+// a reference of the captures it had
+typedef struct AddFrame_ {
+    Inst *pc;
+    Caps *caps;
+} AddFrame;
+
+// a branch the backtracker is to try later, or with restore, the capture
+// pc saved and what it was before
+typedef struct BackFrame_ {
+    Inst *pc;
+    char *sp;
+    int restore;
+} BackFrame;
+
+// everything a match writes. An Re is only read by re_ctx_exec, so
+// threads can share one, each with a ReCtx of its own.
+typedef struct ReCtx_ {
+    Re *re;
+    int *gen;     // generation each Inst was last added to a list in
+    int curgen;   // generation of threadlist
+    int capacity; // max threads
+    ThreadList tpool[2];
+    AddFrame *stack; // pending branches of the threaded addthread
+    Caps *capfree;   // Caps no thread holds, for the next ones
+    uint32_t *visited; // the backtracker's (Inst, offset) bitmap
+    size_t nvisited;   // words of it
+    BackFrame *back;   // the backtracker's branches to try
+    size_t nback;
+    Sub sub[2*NPAREN];
+    char *s;
+    int matched;  // flag that some of threads match
+} ReCtx;
+
 extern ReAst *ast_new(int type, int c, ReAst *lhs, ReAst *rhs);
 extern void *pmalloc(size_t size);
 extern Re *re_new(const char *, int opts);
 extern int re_exec(Re *re, char *s);
 extern void re_free(Re *re);
 
+extern ReCtx *re_ctx_new(Re *re);
+extern int re_ctx_exec(ReCtx *ctx, char *s);
+extern void re_ctx_free(ReCtx *ctx);
+
+extern void re_set_backtrack_bits(Re *re, size_t bits);
 extern void re_setopt(Re *re, int opt);
 extern int re_getopt(Re *re, int opt);
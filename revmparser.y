@@ -17,6 +17,10 @@ static int nparen = 0;
 
 %parse-param { Re *re }
 
+%initial-action {
+    nparen = 0;
+}
+
 %token EOL 
 %token <c> CHAR
 %type <nparen> count
@@ -112,7 +116,7 @@ int yylex()
         return EOL;
     }
 
-    int c = *input++;
+    int c = (unsigned char)*input++; // IChar labels are bytes, 0-255
     if (strchr("*+?:)(|.^$", c)) {
         return c;
     }
@@ -126,9 +130,10 @@ void yyerror(Re *re, const char *msg)
     fprintf(stderr, "parse: %s at %c(%x)\n", msg, *input, *input);
 }
 
+#ifndef REVM_NO_MAIN
 static void usage()
 {
-	fprintf(stderr, "igrepvm regex str\n");
+	fprintf(stderr, "igrepvm regex str...\n");
 }
 
 int main(int argc, char **argv)
@@ -141,11 +146,15 @@ int main(int argc, char **argv)
 	
 	Re *re = re_new(argv[1], 0);
 	
-    int matched = re_exec(re, argv[2]);
-    if (matched) 
-        printf("matched\n");
+    int matched = 0;
+    for (int i = 2; i < argc; ++i) {
+        if (re_exec(re, argv[i])) {
+            printf(argc > 3 ? "%s\n" : "matched\n", argv[i]);
+            matched = 1;
+        }
+    }
     
     re_free(re);
     return matched;
 }
-
+#endif
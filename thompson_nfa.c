@@ -1,8 +1,10 @@
 // see: http://swtch.com/~rsc/regexp/regexp1.html
 // I use a recursive descend parser for the following re grammar :
-// R -> term
-//   -> term R
-//   -> term '|' R;
+// R -> C
+//   -> R '|' C;
+//
+// C -> term
+//   -> term C;
 //
 // term -> prim
 //      -> prim '*'
@@ -20,10 +22,22 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "nfa.h"
 
-#define EINVAL "invalid re"
+#define EBADRE "invalid re"
 
 #define err_quit(msg) {                                          \
         fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, msg); \
@@ -40,7 +54,21 @@ static inline void debug(const char *fmt, ...)
 #endif
 }
 
-#define RE_CACHE_SIZE 32
+#define RE_CACHE_SIZE 32 // states of a shared DFA generation under RE_BOUND_MEM
+#define RE_DFA_BUDGET (64 << 10) // bytes of lazy DFA under RE_BOUND_MEM
+#define RE_THRASH_MIN 256  // DStates built per thrash check of a bounded DFA
+#define RE_THRASH_RATIO 4  // bytes scanned per DState built below which it thrashes
+#define RE_JIT_THRESHOLD (1 << 20) // bytes a lazy DFA scans before RE_JIT compiles it
+#define RE_JIT_MAX_STATES 4096 // largest lazy DFA RE_JIT compiles
+#define RE_JIT_CHAIN 4 // most byte ranges a JIT state tests by compares
+#define RE_DTABLE_INIT 64 // initial slots of DState hash table, power of 2
+#define RE_FULL_DFA_LIMIT 10000 // default state budget of RE_FULL_DFA
+#define RE_PREFIX_MAX 32 // longest literal prefix kept for the prefilter
+#define RE_BYTESET_MAX 8 // largest first-byte set worth a SIMD scan
+#define RE_PF_MIN_SKIP 16 // skip length the prefilter must average in a DFA
+#define RE_PF_MAX_DEBT 1024 // bytes it may fall behind that before it's dropped
+#define RE_BITNFA_MAX 64 // most positions the bit-parallel NFA handles
+#define RE_ARENA_BLOCK 4096 // bytes of the first arena block, later ones double
 
 enum {
     Split = 256,
@@ -51,7 +79,8 @@ typedef struct State_ {
     int c;
     struct State_ *out;
     struct State_ *out1;
-    int lastlist; // for optimization
+    int n;        // index among the States of its RE, see RE_ctx.marks
+    int id;       // Match: pattern id within a RESet, else BitNFA position
 } State;
 
 typedef struct StatePtrList_ {
@@ -70,45 +99,151 @@ typedef struct StateList_ {
     int size;
 } StateList;
 
-typedef struct LinkList_ {
-    void *payload;
-    struct LinkList_ *next;
-} LinkList;
+typedef struct ArenaBlock_ {
+    struct ArenaBlock_ *next; // blocks are chained oldest first
+    size_t used, size;
+    char data[];
+} ArenaBlock;
+
+// bump-pointer allocator, all of it is freed at once. An arena holding one
+// type only can be walked as arrays of it, in allocation order.
+typedef struct Arena_ {
+    ArenaBlock *first, *last;
+} Arena;
 
 typedef struct DState_ {
     StateList sl;
-    struct DState_ * out[256];
-
-    struct DState_ *lhs, *rhs;
+    int nss;     // capacity of sl.ss, freed dstates are recycled
+    int matched; // sl contains Match
+    int used;    // CLOCK reference bit, entered since the last sweep
+    int lastscan; // RESet_match scan that collected this state's matches
+    uint64_t hash; // fingerprint of sl, see list_fingerprint
+    int id;        // creation order, numbers states of a full DFA
+    struct DState_ *next; // link of freed dstates
+    void *code;    // entry of the state in its context's JIT code
+
+    struct DState_ *out[]; // one per byte class, followed by sl.ss
 } DState;
 
-enum RE_option {
-    RE_DFA = 0x01, // build DFA on-the-fly
-    RE_DUMP = 0x02,  // dump automata transitions
-    RE_BOUND_MEM = 0x04,  // bounded memory usage by DFA
-    RE_ANCHOR_HEAD = 0x08, // ^, search only from first
-    RE_ANCHOR_TAIL = 0x10, // $
+// a complete, minimized DFA: a pure table walk, no NFA states behind it.
+// Transitions hold the row offset (state * nclass) of the next state, and
+// accepting states are numbered last so a match is a single compare.
+typedef struct DFATable_ {
+    int nstates;
+    int nclass;
+    int start;       // row offset of the start state
+    int accept_from; // row offset of the first accepting state
+    int *trans;      // nstates x nclass
+    const unsigned char *classmap;
+
+    void *map;       // set if loaded by RE_load, trans points into it
+    size_t maplen;
+} DFATable;
+
+#define DFA_MAGIC "NFADFA"
+#define DFA_VERSION 1
+#define DFA_ENDIAN 0x01020304
+
+// on-disk image written by RE_save. Fields are in native byte order and
+// sections are addressed by offsets from the start of the file, so the
+// image is used in place by RE_load, straight out of a read-only mmap.
+typedef struct DFAFile_ {
+    char magic[8];        // DFA_MAGIC
+    uint32_t version;     // DFA_VERSION
+    uint32_t endian;      // DFA_ENDIAN as written
+    uint32_t options;     // RE options the DFA was built with
+    uint32_t nstates;
+    uint32_t nclass;
+    uint32_t start;
+    uint32_t accept_from;
+    uint32_t rep_len;     // pattern text, without NUL
+    uint64_t classmap_off; // 256 bytes
+    uint64_t trans_off;    // nstates x nclass int32, 8 aligned
+    uint64_t rep_off;
+    uint64_t size;         // whole file
+} DFAFile;
+
+enum {
+    PF_NONE = 0,
+    PF_BYTE,    // one first byte, strchr
+    PF_PREFIX,  // literal prefix, strstr
+    PF_BYTESET, // a few first bytes, SSE2 scan
 };
 
+// where a match can start, skipped to while the automaton sits in its
+// start state
+typedef struct Prefilter_ {
+    int kind;
+    char prefix[RE_PREFIX_MAX + 1];
+    int nbytes;
+    unsigned char bytes[RE_BYTESET_MAX];
+} Prefilter;
+
+struct BitNFA_;
+
 typedef struct REprivate_ {
     char *fp; // frame pointer
     char *rep; // copy of regex literal
 
     int options;  // flags
     int capacity; // NO. of States a NFA have
-    StateList gstore1, gstore2; // temporary storage for NFA State
+    State *matchstate;
+
+    unsigned char classmap[256]; // byte -> byte equivalence class
+    int nclass;
+
+    RE_ctx *ctx;  // RE_match's own context, also used while building
+    struct SharedDFA_ *shared; // lazy DFA of all contexts, RE_SHARED_DFA
+    struct CacheEntry_ *centry; // set if handed out by a RECache
+
+    Prefilter pf;
+    int nstart;         // size of the start closure
+
+    DFATable *fdfa;     // built by RE_FULL_DFA, or for literals
+    int literals;       // fdfa is the Aho-Corasick automaton of the pattern
+    int fdfa_limit;     // state budget for building fdfa
+    size_t dfa_budget;  // bytes of lazy DFA per context, 0 if unbounded
+    size_t jit_threshold; // bytes scanned before RE_JIT, 0 for the default
+
+    struct BitNFA_ *bnfa; // set if the pattern has few enough positions
+
+    REStats retired;   // of the contexts freed, other than ctx
+    double compile_ms;
+
+    Arena states;   // State
+    Arena temp;     // Fragment and StatePtrList, freed before RE_match
+} REprivate;
+
+// everything a match writes. Once compiled and its options set, an RE is
+// only read while matching: threads share one RE, each with its own RE_ctx.
+struct RE_ctx_ {
+    RE *re;
+    int *marks;   // listid a State was last added with, by State.n
     int listid;
+    StateList gstore1, gstore2; // temporary storage for NFA State
+    int scanid;   // RESet_match scans
 
-    DState *dstart;  // root of DFA states binary tree
+    DState **dtable; // open addressing hash table of DFA states
+    int dtable_size; // slots of dtable, power of 2
+    DState *dinit;   // DFA start state, kept across RE_match calls
     int dstate_size;
+    size_t dstate_bytes;
 
     DState *dstates_free; // link list of freed dstates
 
-    // track temp resources for freeing
-    LinkList *pspl; // StatePtrList, this can be freed before RE_match
-    LinkList *pfrags; // Fragment, this can be freed before RE_match
-    LinkList *pss;  // State
-} REprivate;
+    struct EpochSlot_ *slot; // claimed in the shared DFA on first use
+
+    void *jit;        // lazy DFA compiled to x86-64 code, RE_JIT
+    size_t jit_len;   // bytes mapped at jit
+    int jit_states;   // dstate_size when it was compiled
+    char jit_pf;      // the search has a prefilter, jit returns to it
+    unsigned long jit_due;   // st.bytes at which it is compiled (again)
+    unsigned long jit_every; // bytes between compiles, doubles each time
+
+    REStats st; // of the matches run through this context
+};
+
+typedef struct SharedDFA_ SharedDFA;
 
 static char metas[] = "*?+()|";
 
@@ -118,14 +253,16 @@ static inline int isprim(int c)
     return strchr(metas, c) == NULL;
 }
 
+// bytes of the pattern as unsigned, as the subject is read: State labels
+// index tables of 256
 static inline int peek(RE *re)
 {
-    return *(re->priv->fp);
+    return (unsigned char)*(re->priv->fp);
 }
 
 static inline int tok(RE *re)
 {
-    return *(re->priv->fp)++;
+    return (unsigned char)*(re->priv->fp)++;
 }
 
 static inline int eof(RE *re)
@@ -151,43 +288,62 @@ static void dump_frag(const char *head, Fragment *f)
 #endif
 }
 
-static void dump_state(const char *head, State *s)
+static void *arena_alloc(Arena *a, size_t n)
 {
-#ifdef DEBUG
-    int c = s->c ? s->c: 0;
-    c = c == Split ? '/' : (c == Match ? '#': c);
-    fprintf(stderr, "[%s]: State %d: %c, out: %d, out1: %d\n", head, s->lastlist,
-            c, s->out ? s->out->lastlist : 0, s->out1 ? s->out1->lastlist : 0);
+    n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    ArenaBlock *b = a->last;
+    if (!b || b->used + n > b->size) {
+        size_t size = b ? 2 * b->size : RE_ARENA_BLOCK;
+        while (size < n) {
+            size *= 2;
+        }
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->next = NULL;
+        b->used = 0;
+        b->size = size;
+        if (a->last) {
+            a->last->next = b;
+        } else {
+            a->first = b;
+        }
+        a->last = b;
+    }
 
-#endif
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
 }
 
-State* state_new(RE *re, int c, State *out, State *out1)
+static void arena_free(Arena *a)
 {
-    LinkList *old = re->priv->pss;
+    ArenaBlock *b = a->first;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->first = a->last = NULL;
+}
+
+#define arena_foreach(a, T, p)                                         \
+    for (ArenaBlock *b_ = (a)->first; b_; b_ = b_->next)                \
+        for (T *p = (T *)b_->data; p < (T *)(b_->data + b_->used); ++p)
 
-    LinkList *ll = malloc(sizeof(LinkList));
-    State *s = (State*)malloc(sizeof(State));
-    ll->payload = s;
-    ll->next = old;
-    re->priv->pss = ll;
+State* state_new(RE *re, int c, State *out, State *out1)
+{
+    State *s = arena_alloc(&re->priv->states, sizeof(State));
 
     s->c = c;
     s->out = out;
     s->out1 = out1;
-    s->lastlist = 0;
+    s->n = re->priv->capacity++;
+    s->id = 0;
     return s;
 }
 
 Fragment* fragment_new(RE *re, State *start)
 {
-    LinkList *old = re->priv->pfrags;
-
-    LinkList *ll = malloc(sizeof(LinkList));
-    Fragment *f = (Fragment*)malloc(sizeof(Fragment));
-    ll->payload = f;
-    ll->next = old;
-    re->priv->pfrags = ll;
+    Fragment *f = arena_alloc(&re->priv->temp, sizeof(Fragment));
 
     f->start = start;
     f->out = NULL;
@@ -196,13 +352,7 @@ Fragment* fragment_new(RE *re, State *start)
 
 StatePtrList *list1(RE *re, State **outp)
 {
-    LinkList *old = re->priv->pspl;
-
-    LinkList *ll = malloc(sizeof(LinkList));
-    StatePtrList *spl = malloc(sizeof(StatePtrList));
-    ll->payload = spl;
-    ll->next = old;
-    re->priv->pspl = ll;
+    StatePtrList *spl = arena_alloc(&re->priv->temp, sizeof(StatePtrList));
 
     spl->s = outp;
     spl->next = NULL;
@@ -229,14 +379,14 @@ void patch(StatePtrList *l, State *s)
     }
 }
 
-static Fragment *match_re(RE *re, Fragment *lhs);
+static Fragment *match_re(RE *re);
 static Fragment *match_term(RE *re);
 
 static Fragment *match_single(RE *re)
 {
     int t = tok(re);
     if (!isprim(t)) {
-        err_quit(EINVAL);
+        err_quit(EBADRE);
     }
 
     State *s = state_new(re, t, NULL, NULL);
@@ -249,13 +399,13 @@ static Fragment *match_single(RE *re)
 static Fragment *match_bracketed(RE *re)
 {
     if (tok(re) != '(') {
-        err_quit(EINVAL);
+        err_quit(EBADRE);
     }
 
-    Fragment *e1 = match_re(re, NULL);
+    Fragment *e1 = match_re(re);
 
-    if (tok(re) != ')') {
-        err_quit(EINVAL);
+    if (!e1 || tok(re) != ')') {
+        err_quit(EBADRE);
     }
 
     return e1;
@@ -306,31 +456,31 @@ static Fragment *match_uniform(RE *re, Fragment *e)
     }
 
     default:
-        err_quit(EINVAL);
+        err_quit(EBADRE);
         break;
     }
 
     return e1;
 }
 
+static Fragment *match_concat(RE *re);
+
 static Fragment *match_alternate(RE *re, Fragment *e)
 {
     if (tok(re) != '|') {
-        err_quit(EINVAL);
+        err_quit(EBADRE);
     }
 
-    Fragment *e1 = match_term(re);
-    // alternating
-    State *start = state_new(re, Split, e->start, e1->start);
-    Fragment *f = fragment_new(re, start);
-    f->out = append(e->out, e1->out);
-    e1 = f;
-
-    if (eof(re)) {
-        return e1;
+    Fragment *e1 = match_concat(re);
+    if (!e1) {
+        err_quit(EBADRE);
     }
 
-    return match_re(re, e1);
+    // alternating, e1->out is the short list so it goes first
+    State *start = state_new(re, Split, e->start, e1->start);
+    Fragment *f = fragment_new(re, start);
+    f->out = append(e1->out, e->out);
+    return f;
 }
 
 static Fragment *match_term(RE *re)
@@ -348,67 +498,97 @@ static Fragment *match_term(RE *re)
     }
 }
 
-static Fragment *match_re(RE *re, Fragment *lhs)
+// a run of terms up to '|', ')' or the end, NULL if there is none
+static Fragment *match_concat(RE *re)
 {
-    Fragment *e1 = NULL, *e2 = NULL;
-    if (eof(re))
-        return lhs;
-
-    if (peek(re) == ')') {
-        return lhs;
+    Fragment *lhs = NULL, *e1, *e2;
+    while (!eof(re) && peek(re) != ')' && peek(re) != '|') {
+        debug("match_concat: lhs %c\n", lhs ? lhs->start->c : 0);
+        e1 = match_term(re);
+
+        if (lhs) {
+            debug("concate %c . %c\n", lhs->start->c, e1->start->c);
+            patch(lhs->out, e1->start);
+            e2 = fragment_new(re, lhs->start);
+            e2->out = e1->out;
+            e1 = e2;
+        }
+        lhs = e1;
     }
 
-    debug("match_re: lhs %c\n", lhs ? lhs->start->c : 0);
-    e1 = match_term(re);
-
-    if (lhs) {
-        debug("concate %c . %c\n", lhs->start->c, e1->start->c);
-        patch(lhs->out, e1->start);
-        e2 = fragment_new(re, lhs->start);
-        e2->out = e1->out;
-        e1 = e2;
-    }
+    return lhs;
+}
 
-    if (peek(re) == '|') {
-        e2 = match_alternate(re, e1);
-    } else {
-        e2 = match_re(re, e1);
+static Fragment *match_re(RE *re)
+{
+    Fragment *e = match_concat(re);
+    while (e && peek(re) == '|') {
+        e = match_alternate(re, e);
     }
 
-    return e2;
+    return e;
 }
 
-State matchstate = { Match };
-
 // parsing
 static State *compile(RE *re, const char *rep)
 {
-    Fragment *e = match_re(re, NULL);
-    patch(e->out, &matchstate);
+    Fragment *e = match_re(re);
+    if (!e) {
+        err_quit(EBADRE);
+    }
+
+    re->priv->matchstate = state_new(re, Match, NULL, NULL);
+    patch(e->out, re->priv->matchstate);
+    return e->start;
+}
+
+// compile patterns [lo, hi) of a set, each one ending in a Match state of
+// its own, and join them under a balanced tree of Splits
+static State *compile_set(RE *re, const char **pats, int lo, int hi)
+{
+    if (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        State *lhs = compile_set(re, pats, lo, mid);
+        State *rhs = compile_set(re, pats, mid, hi);
+        return state_new(re, Split, lhs, rhs);
+    }
+
+    re->priv->fp = (char *)pats[lo];
+    Fragment *e = match_re(re);
+    if (!e || !eof(re)) {
+        err_quit(EBADRE);
+    }
+
+    State *m = state_new(re, Match, NULL, NULL);
+    m->id = lo;
+    patch(e->out, m);
     return e->start;
 }
 
-static void addstate(RE *re, StateList *store, State *s)
+static void addstate(RE_ctx *ctx, StateList *store, State *s)
 {
-    if (!s || s->lastlist == re->priv->listid)
+    if (!s || ctx->marks[s->n] == ctx->listid)
         return;
 
-    s->lastlist = re->priv->listid;
+    ctx->marks[s->n] = ctx->listid;
 
     if (s->c == Split) {
-        addstate(re, store, s->out);
-        addstate(re, store, s->out1);
+        addstate(ctx, store, s->out);
+        addstate(ctx, store, s->out1);
         return; // so store only contains `core` states
     }
 
     store->ss[store->size++] = s;
 }
 
-static StateList *closure(RE *re, State *s, StateList *store)
+static StateList *closure(RE_ctx *ctx, State *s, StateList *store)
 {
-    ++re->priv->listid;
+    ++ctx->listid;
     store->size = 0;
-    addstate(re, store, s);
+    addstate(ctx, store, s);
+    if (store->size > ctx->st.peak_list) {
+        ctx->st.peak_list = store->size;
+    }
     return store;
 }
 
@@ -423,338 +603,2548 @@ static int ismatched(StateList *sl)
     return 0;
 }
 
-static void step(RE *re, StateList *sl, int c, StateList *next)
+// unless anchored, the start state is re-added after every byte: this is
+// the implicit `.*` loop in front of the pattern, so one forward pass over
+// the input finds a match starting at any offset.
+static void step(RE_ctx *ctx, StateList *sl, int c, StateList *next)
 {
-    ++re->priv->listid;
+    RE *re = ctx->re;
+    ++ctx->listid;
     next->size = 0;
     for (int i = 0; i < sl->size; ++i) {
         State *s = sl->ss[i];
         assert(s->c != Split);
         if (s->c == c) {
-            addstate(re, next, s->out);
+            addstate(ctx, next, s->out);
         }
     }
 
+    if (!RE_getoption(re, RE_ANCHOR_HEAD)) {
+        addstate(ctx, next, re->start);
+    }
+
     assert(next->size <= re->priv->capacity);
+    ctx->st.nfa_steps++;
+    if (next->size > ctx->st.peak_list) {
+        ctx->st.peak_list = next->size;
+    }
 }
 
-static void annotate_nfa(State *s, int id)
+#ifdef STANDALONE
+static void dump_state(const char *head, State *s)
 {
-    if (!s || s->lastlist > 0)
-        return;
+#ifdef DEBUG
+    int c = s->c ? s->c: 0;
+    c = c == Split ? '/' : (c == Match ? '#': c);
+    fprintf(stderr, "[%s]: State %d: %c, out: %d, out1: %d\n", head, s->n,
+            c, s->out ? s->out->n : -1, s->out1 ? s->out1->n : -1);
 
-    s->lastlist = id;
-    annotate_nfa(s->out, ++id);
-    annotate_nfa(s->out1, ++id);
-    dump_state("annotate", s);
+#endif
 }
 
-static void dump_nfa(State *start)
+static void dump_nfa(RE *re)
 {
-    matchstate.lastlist = 1000;
-    annotate_nfa(start, 1);
+    arena_foreach(&re->priv->states, State, s) {
+        dump_state(s == re->start ? "start" : "nfa", s);
+    }
 }
+#endif
 
 static void clean_tempdata(RE *re)
 {
-    LinkList *pp;
-    LinkList **pll = &(re->priv->pspl);
-    while (*pll) {
-        pp = *pll;
-        pll = &((*pll)->next);
-        free(pp->payload);
-        free(pp);
+    arena_free(&re->priv->temp);
+}
+
+// bytes that label no State can't be told apart by the automaton and share
+// class 0, every label byte gets a class of its own. DStates keep one
+// transition per class instead of 256.
+static void build_byteclasses(RE *re)
+{
+    REprivate *priv = re->priv;
+    char labelled[256] = {0};
+    int nlabelled = 0;
+
+    arena_foreach(&priv->states, State, s) {
+        if (s->c < 256 && !labelled[s->c]) {
+            labelled[s->c] = 1;
+            nlabelled++;
+        }
+    }
+
+    priv->nclass = nlabelled < 256 ? 1 : 0;
+    for (int c = 0; c < 256; ++c) {
+        priv->classmap[c] = labelled[c] ? priv->nclass++ : 0;
+    }
+    debug("byte classes: %d\n", priv->nclass);
+}
+
+static StateList *closure(RE_ctx *ctx, State *s, StateList *store);
+static int ismatched(StateList *sl);
+
+// a chain of labelled states from the start is a prefix every match begins
+// with; failing that, the labels of the start closure are the bytes a match
+// can begin with. Nothing is kept if the empty string matches.
+static void build_prefilter(RE *re)
+{
+    REprivate *priv = re->priv;
+    Prefilter *pf = &priv->pf;
+    StateList *sl = closure(priv->ctx, re->start, &(priv->ctx->gstore1));
+
+    priv->nstart = sl->size;
+    pf->kind = PF_NONE;
+    if (ismatched(sl)) {
+        return;
+    }
+
+    int len = 0;
+    for (State *s = re->start; s->c < 256 && len < RE_PREFIX_MAX; s = s->out) {
+        pf->prefix[len++] = s->c;
+    }
+    pf->prefix[len] = 0;
+    if (len > 1) {
+        pf->kind = PF_PREFIX;
+        debug("prefilter: prefix %s\n", pf->prefix);
+        return;
+    }
+
+    pf->nbytes = 0;
+    for (int i = 0; i < sl->size; ++i) {
+        int c = sl->ss[i]->c;
+        if (memchr(pf->bytes, c, pf->nbytes)) {
+            continue;
+        }
+        if (pf->nbytes == RE_BYTESET_MAX) {
+            return;
+        }
+        pf->bytes[pf->nbytes++] = c;
+    }
+    pf->kind = pf->nbytes == 1 ? PF_BYTE : PF_BYTESET;
+    debug("prefilter: %d first bytes\n", pf->nbytes);
+}
+
+// aligned 16 byte loads never cross a page, so reading past the NUL within
+// the last block is safe (though not to the address sanitizer)
+__attribute__((no_sanitize_address))
+static const char *scan_byteset(const Prefilter *pf, const char *s)
+{
+#ifdef __SSE2__
+    uintptr_t skew = (uintptr_t)s & 15;
+    const __m128i *p = (const __m128i *)(s - skew);
+    unsigned keep = (0xffff << skew) & 0xffff;
+    __m128i set[RE_BYTESET_MAX];
+    for (int i = 0; i < pf->nbytes; ++i) {
+        set[i] = _mm_set1_epi8(pf->bytes[i]);
+    }
+
+    for (;; ++p, keep = 0xffff) {
+        __m128i v = _mm_load_si128(p);
+        __m128i hit = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+        for (int i = 0; i < pf->nbytes; ++i) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, set[i]));
+        }
+
+        unsigned m = _mm_movemask_epi8(hit) & keep;
+        if (m) {
+            const char *r = (const char *)p + __builtin_ctz(m);
+            return *r ? r : NULL;
+        }
+    }
+#else
+    for (; *s; ++s) {
+        if (memchr(pf->bytes, *s, pf->nbytes)) {
+            return s;
+        }
+    }
+    return NULL;
+#endif
+}
+
+// next position at or after s where a match may start, NULL if none
+static const char *prefilter_next(const Prefilter *pf, const char *s)
+{
+    switch (pf->kind) {
+    case PF_BYTE:
+        return strchr(s, pf->bytes[0]);
+    case PF_PREFIX:
+        return strstr(s, pf->prefix);
+    case PF_BYTESET:
+        return scan_byteset(pf, s);
+    default:
+        return s;
     }
-    re->priv->pspl = NULL;
+}
 
-    pll = &(re->priv->pfrags);
-    while (*pll) {
-        pp = *pll;
-        pll = &((*pll)->next);
-        free(pp->payload);
-        free(pp);
+// a DFA step is cheap, so for the DFAs the prefilter only pays off while
+// candidates are sparse. Each call earns its skip length minus
+// RE_PF_MIN_SKIP; once the balance drops below -RE_PF_MAX_DEBT the
+// prefilter is dropped for the rest of the scan.
+static inline const char *dfa_prefilter_next(const Prefilter **pf, long *credit,
+                                             const char *s)
+{
+    const char *p = prefilter_next(*pf, s);
+    if (p) {
+        *credit += (p - s) - RE_PF_MIN_SKIP;
+        if (*credit < -RE_PF_MAX_DEBT) {
+            *pf = NULL;
+        }
     }
-    re->priv->pfrags = NULL;
+    return p;
+}
 
+static int use_prefilter(RE *re)
+{
+    return re->priv->pf.kind != PF_NONE
+        && !RE_getoption(re, RE_ANCHOR_HEAD | RE_NO_PREFILTER);
 }
 
-RE *RE_compile(const char *rep)
+static RE *re_alloc(const char *rep)
 {
     RE *re = malloc(sizeof(RE));
     re->priv = malloc(sizeof(REprivate));
     bzero(re->priv, sizeof(REprivate));
     re->priv->rep = strdup(rep);
     re->priv->fp = re->priv->rep;
-
-    re->start = compile(re, rep);
     return re;
 }
 
-void RE_setoption(RE *re, enum RE_option opt)
+// everything derived from the NFA once re->start is built
+static void re_finish(RE *re)
 {
-    re->priv->options |= opt;
+    REprivate *priv = re->priv;
+
+    clean_tempdata(re);
+    build_byteclasses(re);
+    priv->ctx = RE_ctx_new(re);
+    priv->fdfa_limit = RE_FULL_DFA_LIMIT;
+    build_prefilter(re);
 }
 
-int RE_getoption(RE *re, enum RE_option opt)
+static int build_ahocorasick(RE *re);
+static int build_bitnfa(RE *re);
+
+static double now_ms(void)
 {
-    return re->priv->options & opt;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
 }
 
-static int ptrcmp(const void *p1, const void *p2)
+// the prefilter and bit-parallel NFA ran closures through the RE's own
+// context, its counts start with the first search
+static void compile_done(RE *re, double t)
 {
-    if (p1 - p2 > 0) {
-        return 1;
-    } else if (p1 - p2 < 0) {
-        return -1;
-    }
-
-    return 0;
+    memset(&re->priv->ctx->st, 0, sizeof re->priv->ctx->st);
+    re->priv->compile_ms = now_ms() - t;
 }
 
-static int listcmp(const StateList *sl1, const StateList *sl2)
+RE *RE_compile(const char *rep)
 {
-    if (sl1->size < sl2->size) {
-        return -1;
+    double t = now_ms();
+    RE *re = re_alloc(rep);
+    re->start = compile(re, rep);
+    re_finish(re);
+    if (!build_ahocorasick(re)) {
+        build_bitnfa(re);
     }
+    compile_done(re, t);
+    return re;
+}
 
-    if (sl1->size > sl2->size) {
-        return 1;
+static void free_dfa(RE_ctx *ctx);
+static void free_full_dfa(RE *re);
+static int build_full_dfa(RE *re);
+static SharedDFA *shared_new(RE *re);
+static void shared_free(SharedDFA *sh);
+
+void RE_setoption(RE *re, enum RE_option opt)
+{
+    REprivate *priv = re->priv;
+
+    if (!re->start) { // loaded by RE_load, options are fixed in the image
+        return;
     }
 
-    for (int i = 0; i < sl1->size; ++i) {
-        if (sl1->ss[i] > sl2->ss[i]) {
-            return 1;
-        } else if (sl1->ss[i] < sl2->ss[i]) {
-            return -1;
-        }
+    // cached DStates embed the unanchored start loop, drop them on change.
+    // Contexts other than the RE's own must be created after this.
+    if ((opt & RE_ANCHOR_HEAD) && !RE_getoption(re, RE_ANCHOR_HEAD)) {
+        free_dfa(priv->ctx);
+        free_full_dfa(re);
+        shared_free(priv->shared);
+        priv->shared = NULL;
     }
 
-    return 0;
-}
+    priv->options |= opt;
 
-static DState *dstate_from_list(RE *re, StateList *next_sl)
-{
-    DState *next = NULL;
-    qsort(next_sl->ss, next_sl->size, sizeof next_sl->ss[0], ptrcmp);
-
-    DState **ppd = &(re->priv->dstart);
-    while (*ppd) {
-        StateList *sl = &((*ppd)->sl);
-        switch(listcmp(next_sl, sl)) {
-        case 1:
-            ppd = &((*ppd)->lhs); break;
-        case -1:
-            ppd = &((*ppd)->rhs); break;
-        case 0:
-            debug("DFA state already exists, reuse\n");
-            return *ppd;
-        }
+    if (RE_getoption(re, RE_JIT)) {
+        priv->options |= RE_DFA;
     }
 
-    if (re->priv->dstates_free) {
-        next = re->priv->dstates_free;
-        re->priv->dstates_free = next->lhs;
-
-    } else {
-        next = malloc(sizeof *next + sizeof next_sl->ss[0] * next_sl->size);
-        next->sl.ss = (State **)(next + 1);
+    if (RE_getoption(re, RE_SHARED_DFA)) {
+        priv->options |= RE_DFA;
+        if (!priv->shared) {
+            priv->shared = shared_new(re);
+        }
     }
 
-    bzero(next->out, sizeof next->out);
-    memcpy(next->sl.ss, next_sl->ss, sizeof next_sl->ss[0] * next_sl->size);
-    next->sl.size = next_sl->size;
-    next->lhs = next->rhs = NULL;
-    *ppd = next;
+    // a full DFA that blows the state budget falls back to the lazy one
+    if (RE_getoption(re, RE_FULL_DFA) && !priv->fdfa && !build_full_dfa(re)) {
+        debug("full DFA exceeds %d states, fall back to lazy DFA\n",
+              priv->fdfa_limit);
+        priv->options &= ~RE_FULL_DFA;
+        priv->options |= RE_DFA;
+    }
+}
 
-    re->priv->dstate_size++;
-    return next;
+void RE_set_dfa_budget(RE *re, size_t bytes)
+{
+    re->priv->dfa_budget = bytes;
 }
 
-static DState *start_dstate(RE *re, State *s)
+static size_t dfa_budget(RE *re)
 {
-    re->priv->dstart = dstate_from_list(
-        re, closure(re, s, &(re->priv->gstore1)));
-    return re->priv->dstart;
+    if (re->priv->dfa_budget) {
+        return re->priv->dfa_budget;
+    }
+    return RE_getoption(re, RE_BOUND_MEM) ? RE_DFA_BUDGET : 0;
 }
 
-static void free_dfa(RE *re);
-static DState *dstep(RE *re, DState *d, int c)
+void RE_set_jit_threshold(RE *re, size_t bytes)
 {
-    DState *next = NULL;
+    re->priv->jit_threshold = bytes;
+}
 
-    StateList *next_sl = &(re->priv->gstore1);
-    step(re, &(d->sl), c, next_sl);
+void RE_set_full_dfa_limit(RE *re, int maxstates)
+{
+    re->priv->fdfa_limit = maxstates;
+}
 
-    DState **ppd;
-    if (RE_getoption(re, RE_BOUND_MEM) && re->priv->dstate_size >= RE_CACHE_SIZE) {
-        free_dfa(re);
-        ppd = &(re->priv->dstart);
+int RE_getoption(RE *re, enum RE_option opt)
+{
+    return re->priv->options & opt;
+}
 
-    } else {
+static inline uint64_t state_hash(const State *s)
+{
+    uint64_t h = (uint64_t)(uintptr_t)s;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
-        ppd = &(d->out[c]);
+// canonical fingerprint of a state set: a sum of per-state hashes does not
+// depend on the order states were added, so the list needs no sorting.
+static uint64_t list_fingerprint(const StateList *sl)
+{
+    uint64_t h = sl->size;
+    for (int i = 0; i < sl->size; ++i) {
+        h += state_hash(sl->ss[i]);
     }
 
-    *ppd = dstate_from_list(re, next_sl);
-    debug("new transition: %x [%c] -> %x\n", d, c, *ppd);
-    return *ppd;
+    return h;
 }
 
-static int dmatch(RE *re, const char *s)
+// right after closure() or step(), exactly the core states of sl carry the
+// current listid, so d holds the same set iff it has as many states and
+// all of them are stamped.
+static int dstate_equal(RE_ctx *ctx, const DState *d, const StateList *sl, uint64_t h)
 {
-    REprivate *priv = re->priv;
-
-    DState *d = start_dstate(re, re->start);
-    DState *next;
-    while (*s) {
-        if ((next = d->out[*s]) == NULL) {
-            next = dstep(re, d, *s);
-        }
+    if (d->hash != h || d->sl.size != sl->size) {
+        return 0;
+    }
 
-        if (ismatched(&(next->sl))) {
-            return 1;
+    for (int i = 0; i < d->sl.size; ++i) {
+        if (ctx->marks[d->sl.ss[i]->n] != ctx->listid) {
+            return 0;
         }
-
-        ++s;
-        d = next;
     }
 
-    return 0;
+    return 1;
 }
 
-static int nfa_match(RE *re, const char *s)
+static void dtable_grow(RE_ctx *ctx)
 {
-    REprivate *priv = re->priv;
-
-    StateList *cl, *nl, *t;
-    cl = closure(re, re->start, &(priv->gstore1));
-    nl = &(priv->gstore2);
-
-    while (*s) {
-        step(re, cl, *s++, nl);
-        t = nl, nl = cl, cl = t;
-        if (ismatched(cl)) {
-            return 1;
+    int size = ctx->dtable_size ? ctx->dtable_size * 2 : RE_DTABLE_INIT;
+    DState **table = calloc(size, sizeof(DState*));
+
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        DState *d = ctx->dtable[i];
+        if (d) {
+            int j = d->hash & (size - 1);
+            while (table[j]) {
+                j = (j + 1) & (size - 1);
+            }
+            table[j] = d;
         }
     }
 
-    return 0;
+    free(ctx->dtable);
+    ctx->dtable = table;
+    ctx->dtable_size = size;
 }
 
-int RE_match(RE *re, const char *s)
+static size_t dstate_bytes(int nclass, int nss)
 {
-    clean_tempdata(re); // reduce memory usage
+    return sizeof(DState) + sizeof(DState*) * nclass + sizeof(State*) * nss;
+}
 
-    REprivate *priv = re->priv;
-    priv->capacity = 128;
-    priv->gstore1.ss = (State**)malloc(sizeof(State*) * priv->capacity);
-    priv->gstore2.ss = (State**)malloc(sizeof(State*) * priv->capacity);
+// must be called while the listid stamps of next_sl are current
+static DState *dstate_from_list(RE_ctx *ctx, StateList *next_sl)
+{
+    int nclass = ctx->re->priv->nclass;
+    DState *next = NULL;
 
-    const char *p = s;
-    if (RE_getoption(re, RE_DFA)) {
-        debug("run in DFA mode\n");
-        int done = 0;
-        while (*s && (done = dmatch(re, s)) == 0) {
-            free_dfa(re);
-            debug("try at position %d\n", ++s - p);
+    if (2 * (ctx->dstate_size + 1) > ctx->dtable_size) {
+        dtable_grow(ctx);
+    }
+
+    uint64_t h = list_fingerprint(next_sl);
+    int mask = ctx->dtable_size - 1;
+    int i = h & mask;
+    for (; ctx->dtable[i]; i = (i + 1) & mask) {
+        if (dstate_equal(ctx, ctx->dtable[i], next_sl, h)) {
+            debug("DFA state already exists, reuse\n");
+            return ctx->dtable[i];
         }
+    }
+
+    if (ctx->dstates_free) {
+        next = ctx->dstates_free;
+        ctx->dstates_free = next->next;
+        if (next->nss < next_sl->size) {
+            free(next);
+            next = NULL;
+        }
+    }
 
-        return done;
+    if (!next) {
+        next = malloc(dstate_bytes(nclass, next_sl->size));
+        next->sl.ss = (State **)(next->out + nclass);
+        next->nss = next_sl->size;
     }
 
-    return nfa_match(re, s);
+    bzero(next->out, sizeof next->out[0] * nclass);
+    memcpy(next->sl.ss, next_sl->ss, sizeof next_sl->ss[0] * next_sl->size);
+    next->sl.size = next_sl->size;
+    next->matched = ismatched(next_sl);
+    next->used = 1;
+    next->lastscan = 0;
+    next->hash = h;
+    next->next = NULL;
+    next->code = NULL;
+    ctx->dtable[i] = next;
+
+    ctx->dstate_size++;
+    ctx->dstate_bytes += dstate_bytes(nclass, next->nss);
+    ctx->st.dfa_states++;
+    return next;
 }
 
-static void free_dstate(RE *re, DState *d)
+static void jit_free(RE_ctx *ctx);
+
+// CLOCK sweep over a lazy DFA past its budget. States not entered since the
+// last sweep are evicted and the others lose their reference bit; a and b,
+// the states of the transition being added, and the start state always
+// stay. If that leaves more than half the budget in use, every other state
+// goes too. Transitions into evicted states are cut, so the survivors keep
+// all their other transitions.
+static void dfa_sweep(RE_ctx *ctx, DState *a, DState *b, size_t budget)
 {
-    if (!d) {
-        return;
+    int nclass = ctx->re->priv->nclass;
+    size_t left = ctx->dstate_bytes;
+    jit_free(ctx); // its code jumps straight into evicted states
+    for (int all = 0; all < 2 && left > budget / 2; ++all) {
+        for (int i = 0; i < ctx->dtable_size; ++i) {
+            DState *d = ctx->dtable[i];
+            if (d && d->used >= 0 && (all || !d->used)
+                && d != a && d != b && d != ctx->dinit) {
+                d->used = -1;
+                left -= dstate_bytes(nclass, d->nss);
+            }
+        }
+    }
+
+    DState **table = calloc(ctx->dtable_size, sizeof(DState*));
+    int mask = ctx->dtable_size - 1;
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        DState *d = ctx->dtable[i];
+        if (!d || d->used < 0) {
+            continue;
+        }
+        for (int c = 0; c < nclass; ++c) {
+            if (d->out[c] && d->out[c]->used < 0) {
+                d->out[c] = NULL;
+            }
+        }
+        d->used = 0;
+        int j = d->hash & mask;
+        while (table[j]) {
+            j = (j + 1) & mask;
+        }
+        table[j] = d;
     }
 
-    free_dstate(re, d->lhs);
-    free_dstate(re, d->rhs);
-    d->lhs = re->priv->dstates_free;
-    re->priv->dstates_free = d;
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        DState *d = ctx->dtable[i];
+        if (d && d->used < 0) {
+            d->next = ctx->dstates_free;
+            ctx->dstates_free = d;
+            ctx->dstate_size--;
+        }
+    }
+    free(ctx->dtable);
+    ctx->dtable = table;
+    ctx->st.sweeps++;
+    debug("DFA sweep: %zu of %zu bytes kept\n", left, ctx->dstate_bytes);
+    ctx->dstate_bytes = left;
 }
 
-static void free_dfa(RE *re)
+static DState *start_dstate(RE_ctx *ctx, State *s)
 {
-    REprivate *priv = re->priv;
-
-    free_dstate(re, priv->dstart);
-    priv->dstate_size = 0;
-    priv->dstart = NULL;
+    if (!ctx->dinit) {
+        ctx->dinit = dstate_from_list(ctx, closure(ctx, s, &(ctx->gstore1)));
+    }
+    return ctx->dinit;
 }
 
-static void release_dstates(RE *re)
+static DState *dstep(RE_ctx *ctx, DState *d, int c)
 {
-    REprivate *priv = re->priv;
-    debug("states before release: %d\n", priv->dstate_size);
+    RE *re = ctx->re;
+    size_t budget = dfa_budget(re);
 
-    DState **sq = alloca(sizeof(DState*) * priv->dstate_size);
-    DState **sqp = sq;
+    StateList *next_sl = &(ctx->gstore1);
+    step(ctx, &(d->sl), c, next_sl);
+    ctx->st.dfa_misses++;
 
-    DState *d = priv->dstart;
-    *sqp++ = d;
-    while (sqp > sq) {
-        d = *--sqp;
-        if (d->lhs) *sqp++ = d->lhs;
-        if (d->rhs) *sqp++ = d->rhs;
-
-        priv->dstate_size--;
-        free(d);
+    DState *next = d->out[re->priv->classmap[c]] = dstate_from_list(ctx, next_sl);
+    debug("new transition: %p [%c] -> %p\n", d, c, next);
+    if (budget && ctx->dstate_bytes > budget) {
+        dfa_sweep(ctx, d, next, budget);
     }
-
-    priv->dstart = NULL;
-    assert(priv->dstate_size == 0);
+    return next;
 }
 
-void RE_free(RE *re)
-{
-    free(re->priv->gstore2.ss);
-    free(re->priv->gstore1.ss);
-    free(re->priv->rep);
-
-    clean_tempdata(re);
+static int nfa_run(RE_ctx *ctx, StateList *cl, StateList *nl, const char *s);
 
-    LinkList **pll = &(re->priv->pss);
-    while (*pll) {
-        LinkList *pp = *pll;
-        pll = &((*pll)->next);
-        free(pp->payload);
-        free(pp);
+// A DFA over its budget thrashes when it builds a state every few bytes:
+// each of those bytes costs an NFA step and a sweep share on top of the
+// lookup. Once a search has swept, every RE_THRASH_MIN states built are
+// checked against the bytes scanned meanwhile.
+static int dfa_thrashing(RE_ctx *ctx, unsigned long sweeps, const char **mark,
+                         unsigned long *built, const char *s)
+{
+    if (!*mark) {
+        if (ctx->st.sweeps != sweeps) {
+            *mark = s;
+            *built = ctx->st.dfa_states;
+        }
+        return 0;
     }
 
-    if (re->priv->dstart) { // free DFA caches
-        release_dstates(re);
+    unsigned long n = ctx->st.dfa_states - *built;
+    if (n < RE_THRASH_MIN) {
+        return 0;
     }
-
-    free(re->priv);
-    free(re);
+    if ((unsigned long)(s - *mark) < n * RE_THRASH_RATIO) {
+        return 1;
+    }
+    *mark = s;
+    *built = ctx->st.dfa_states;
+    return 0;
 }
 
-#ifdef STANDALONE
-char *progname = NULL;
-int main(int argc, char *argv[])
+// a lazy DFA search stepped n bytes, the misses since misses0 among them
+static inline void dfa_scanned(RE_ctx *ctx, unsigned long n,
+                               unsigned long misses0)
 {
-    State *nfa;
-    progname = basename(argv[0]);
+    ctx->st.bytes += n;
+    ctx->st.dfa_hits += n - (ctx->st.dfa_misses - misses0);
+}
 
-    if (argc == 3) {
+#if defined(__x86_64__)
+// RE_JIT: the lazy DFA as x86-64 code. A state that is not matched becomes
+// a block that loads a byte, returns on the NUL and jumps straight to the
+// block of the next state, by compares over the byte ranges the state's
+// transitions cut the alphabet into, or through a table of 256 offsets if
+// there are more than RE_JIT_CHAIN ranges. No class map, no table of
+// DStates, no check for a transition that isn't built: those jump out.
+// A block is called as a JitBlock and returns the state it stops in, with
+// *end at the byte it stops before:
+//   - a matched state, past the byte that got there
+//   - the state at the NUL, or whose transition on *end isn't built yet
+//   - the start state, past the byte that got there, when the search has a
+//     prefilter to skip ahead from it (ctx->jit_pf)
+// The code is written, then mapped read-execute, never both.
+typedef DState *(*JitBlock)(const char *s, const char **end);
+
+// labels of table slot i: JIT_LABELS * i + kind
+enum { JIT_BLOCK, JIT_RET, JIT_MISSING, JIT_GATE, JIT_LABELS };
+
+typedef struct JitFix_ {
+    size_t at;   // int32 to write, label less base
+    size_t base;
+    int label;
+} JitFix;
+
+typedef struct JitCode_ {
+    unsigned char *p;
+    size_t n, max;
+    JitFix *fix;
+    int nfix, maxfix;
+} JitCode;
+
+#define JIT_EMIT(c, ...) do {                     \
+        unsigned char b_[] = { __VA_ARGS__ };     \
+        jit_emit(c, b_, sizeof b_);               \
+    } while (0)
+
+static void jit_emit(JitCode *c, const void *b, size_t n)
+{
+    if (c->n + n > c->max) {
+        c->max = 2 * (c->n + n);
+        c->p = realloc(c->p, c->max);
+    }
+    memcpy(c->p + c->n, b, n);
+    c->n += n;
+}
+
+static void jit_emit32(JitCode *c, int32_t v)
+{
+    jit_emit(c, &v, sizeof v);
+}
+
+static void jit_ref(JitCode *c, int label, size_t base)
+{
+    if (c->nfix == c->maxfix) {
+        c->maxfix = c->maxfix ? 2 * c->maxfix : 256;
+        c->fix = realloc(c->fix, sizeof c->fix[0] * c->maxfix);
+    }
+    c->fix[c->nfix++] = (JitFix){ c->n, base, label };
+    jit_emit32(c, 0);
+}
+
+// rel32 operand ending an instruction
+static void jit_rel32(JitCode *c, int label)
+{
+    jit_ref(c, label, c->n + 4);
+}
+
+static void jit_patch(JitCode *c, size_t at, size_t target)
+{
+    int32_t v = target - (at + 4);
+    memcpy(c->p + at, &v, sizeof v);
+}
+
+static int jit_slot(RE_ctx *ctx, const DState *d)
+{
+    int mask = ctx->dtable_size - 1;
+    int i = d->hash & mask;
+    while (ctx->dtable[i] != d) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// ranges a..b of the byte in %eax, range k from lo[k] up to lo[k + 1]
+static void jit_search(JitCode *c, const int *lo, const int *label, int a, int b)
+{
+    if (a == b) {
+        JIT_EMIT(c, 0xE9);                      // jmp label
+        jit_rel32(c, label[a]);
+        return;
+    }
+
+    int m = (a + b + 1) / 2;
+    JIT_EMIT(c, 0x3D);                          // cmp $lo, %eax
+    jit_emit32(c, lo[m]);
+    JIT_EMIT(c, 0x0F, 0x83);                    // jae
+    if (m == b) {
+        jit_rel32(c, label[b]);
+        jit_search(c, lo, label, a, m - 1);
+        return;
+    }
+    size_t right = c->n;
+    jit_emit32(c, 0);
+    jit_search(c, lo, label, a, m - 1);
+    jit_patch(c, right, c->n);
+    jit_search(c, lo, label, m, b);
+}
+
+// return d with *end at %rdi
+static void jit_ret(JitCode *c, size_t *labels, int i, DState *d)
+{
+    labels[JIT_LABELS * i + JIT_RET] = c->n;
+    JIT_EMIT(c, 0x48, 0x89, 0x3E,               // mov %rdi, (%rsi)
+             0x48, 0xB8);                       // mov $d, %rax
+    uint64_t v = (uintptr_t)d;
+    jit_emit(c, &v, sizeof v);
+    JIT_EMIT(c, 0xC3);                          // ret
+}
+
+static void jit_block(JitCode *c, RE_ctx *ctx, size_t *labels, int *to, int i,
+                      int pf)
+{
+    DState *d = ctx->dtable[i];
+    const unsigned char *classmap = ctx->re->priv->classmap;
+
+    for (int k = 0; k < ctx->re->priv->nclass; ++k) {
+        DState *t = d->out[k];
+        if (!t) {
+            to[k] = JIT_LABELS * i + JIT_MISSING;
+        } else if (t->matched) {
+            to[k] = JIT_LABELS * jit_slot(ctx, t) + JIT_RET;
+        } else if (pf && t == ctx->dinit) {
+            to[k] = JIT_LABELS * jit_slot(ctx, t) + JIT_GATE;
+        } else {
+            to[k] = JIT_LABELS * jit_slot(ctx, t) + JIT_BLOCK;
+        }
+    }
+    int lo[256], label[256], n = 0;
+    for (int b = 1; b < 256; ++b) {
+        int l = to[classmap[b]];
+        if (!n || label[n - 1] != l) {
+            lo[n] = b;
+            label[n++] = l;
+        }
+    }
+
+    if (pf && d == ctx->dinit) {
+        labels[JIT_LABELS * i + JIT_GATE] = c->n;
+        JIT_EMIT(c, 0x48, 0xB9);                // mov $jit_pf, %rcx
+        uint64_t v = (uintptr_t)&ctx->jit_pf;
+        jit_emit(c, &v, sizeof v);
+        JIT_EMIT(c, 0x80, 0x39, 0x00,           // cmpb $0, (%rcx)
+                 0x0F, 0x85);                   // jne ret
+        jit_rel32(c, JIT_LABELS * i + JIT_RET);
+    }
+    labels[JIT_LABELS * i + JIT_BLOCK] = c->n;
+    JIT_EMIT(c, 0x0F, 0xB6, 0x07,               // movzbl (%rdi), %eax
+             0x85, 0xC0,                        // test %eax, %eax
+             0x0F, 0x84);                       // jz ret
+    jit_rel32(c, JIT_LABELS * i + JIT_RET);
+    JIT_EMIT(c, 0x48, 0xFF, 0xC7);              // inc %rdi
+    if (n <= RE_JIT_CHAIN) {
+        jit_search(c, lo, label, 0, n - 1);
+    } else {
+        JIT_EMIT(c, 0x48, 0x8D, 0x15,           // lea table(%rip), %rdx
+                 9, 0, 0, 0,
+                 0x48, 0x63, 0x0C, 0x82,        // movslq (%rdx,%rax,4), %rcx
+                 0x48, 0x01, 0xD1,              // add %rdx, %rcx
+                 0xFF, 0xE1);                   // jmp *%rcx
+        size_t table = c->n;
+        for (int b = 0; b < 256; ++b) {
+            jit_ref(c, b ? to[classmap[b]] : JIT_LABELS * i + JIT_MISSING,
+                    table);
+        }
+    }
+
+    labels[JIT_LABELS * i + JIT_MISSING] = c->n;
+    JIT_EMIT(c, 0x48, 0xFF, 0xCF);              // dec %rdi
+    jit_ret(c, labels, i, d);
+}
+
+static void jit_free(RE_ctx *ctx)
+{
+    if (!ctx->jit) {
+        return;
+    }
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        if (ctx->dtable[i]) {
+            ctx->dtable[i]->code = NULL;
+        }
+    }
+    munmap(ctx->jit, ctx->jit_len);
+    ctx->jit = NULL;
+    ctx->jit_len = 0;
+}
+
+static void dfa_jit(RE_ctx *ctx)
+{
+    if (ctx->dstate_size > RE_JIT_MAX_STATES) {
+        debug("DFA of %d states not compiled\n", ctx->dstate_size);
+        return;
+    }
+
+    int pf = use_prefilter(ctx->re);
+    JitCode c = { NULL };
+    size_t *labels = malloc(sizeof labels[0] * JIT_LABELS * ctx->dtable_size);
+    int *to = malloc(sizeof to[0] * ctx->re->priv->nclass);
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        DState *d = ctx->dtable[i];
+        if (d && d->matched) {
+            jit_ret(&c, labels, i, d);
+        } else if (d) {
+            jit_block(&c, ctx, labels, to, i, pf);
+        }
+    }
+    for (int i = 0; i < c.nfix; ++i) {
+        int32_t v = labels[c.fix[i].label] - c.fix[i].base;
+        memcpy(c.p + c.fix[i].at, &v, sizeof v);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (c.n + page - 1) / page * page;
+    void *code = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, c.p, c.n);
+    }
+    if (code != MAP_FAILED && mprotect(code, len, PROT_READ | PROT_EXEC) < 0) {
+        // W^X refused: keep interpreting, and whatever was compiled before
+        munmap(code, len);
+        code = MAP_FAILED;
+        debug("DFA of %d states not made executable\n", ctx->dstate_size);
+    }
+    if (code != MAP_FAILED) {
+        jit_free(ctx);
+        ctx->jit = code;
+        ctx->jit_len = len;
+        ctx->jit_states = ctx->dstate_size;
+        for (int i = 0; i < ctx->dtable_size; ++i) {
+            DState *d = ctx->dtable[i];
+            if (d && !d->matched) {
+                d->code = (char *)code + labels[JIT_LABELS * i + JIT_BLOCK];
+            }
+        }
+        ctx->st.jit_builds++;
+        debug("DFA of %d states compiled to %zu bytes\n", ctx->dstate_size, c.n);
+    }
+
+    free(to);
+    free(labels);
+    free(c.fix);
+    free(c.p);
+}
+#else
+typedef DState *(*JitBlock)(const char *s, const char **end);
+
+static void jit_free(RE_ctx *ctx)
+{
+}
+
+static void dfa_jit(RE_ctx *ctx)
+{
+}
+#endif
+
+// bytes into a search at which its lazy DFA is to be compiled
+static unsigned long jit_at(RE_ctx *ctx, int clock)
+{
+    RE *re = ctx->re;
+    if (!RE_getoption(re, RE_JIT) || clock) {
+        return ULONG_MAX;
+    }
+    if (!ctx->jit_every) {
+        ctx->jit_every = re->priv->jit_threshold ? re->priv->jit_threshold
+                                                 : RE_JIT_THRESHOLD;
+        ctx->jit_due = ctx->st.bytes + ctx->jit_every;
+    }
+    return ctx->jit_due > ctx->st.bytes ? ctx->jit_due - ctx->st.bytes : 0;
+}
+
+// jit_at was reached n bytes into a search: compile the states built since
+// the last time, if any, and return when to look again
+static unsigned long dfa_jit_due(RE_ctx *ctx, unsigned long n)
+{
+    if (ctx->dstate_size != ctx->jit_states) {
+        dfa_jit(ctx);
+    }
+    ctx->jit_every *= 2;
+    ctx->jit_due = ctx->st.bytes + n + ctx->jit_every;
+    return n + ctx->jit_every;
+}
+
+static int dmatch(RE_ctx *ctx, const char *s)
+{
+    RE *re = ctx->re;
+    const unsigned char *classmap = re->priv->classmap;
+    const Prefilter *pf = use_prefilter(re) ? &re->priv->pf : NULL;
+    long credit = 0;
+    int clock = dfa_budget(re) != 0;
+    unsigned long sweeps = ctx->st.sweeps, built = 0;
+    unsigned long n = 0, misses0 = ctx->st.dfa_misses;
+    const char *mark = NULL;
+    unsigned long jit = jit_at(ctx, clock);
+    DState *d = start_dstate(ctx, re->start);
+    DState *next;
+    if (d->matched) {
+        return 1;
+    }
+
+    while (*s) {
+        if (pf && d == ctx->dinit
+            && (s = dfa_prefilter_next(&pf, &credit, s)) == NULL) {
+            dfa_scanned(ctx, n, misses0);
+            return 0;
+        }
+
+        // the compiled DFA runs until it needs the tables, they take the
+        // next byte
+        if (d->code) {
+            const char *end;
+            ctx->jit_pf = pf != NULL;
+            d = ((JitBlock)d->code)(s, &end);
+            n += end - s;
+            ctx->st.jit_bytes += end - s;
+            s = end;
+            if (d->matched) {
+                dfa_scanned(ctx, n, misses0);
+                return 1;
+            }
+            if (!*s) {
+                break;
+            }
+        }
+
+        int c = (unsigned char)*s;
+        int miss = (next = d->out[classmap[c]]) == NULL;
+        if (miss) {
+            next = dstep(ctx, d, c);
+        }
+        if (++n >= jit) {
+            jit = dfa_jit_due(ctx, n);
+        }
+
+        if (next->matched) {
+            dfa_scanned(ctx, n, misses0);
+            return 1;
+        }
+        if (clock) {
+            next->used = 1;
+            if (miss && dfa_thrashing(ctx, sweeps, &mark, &built, s)) {
+                debug("DFA thrashing, NFA from %p\n", s + 1);
+                ctx->st.restarts++;
+                dfa_scanned(ctx, n, misses0);
+                StateList *cl = &(ctx->gstore1);
+                memcpy(cl->ss, next->sl.ss, sizeof cl->ss[0] * next->sl.size);
+                cl->size = next->sl.size;
+                return nfa_run(ctx, cl, &(ctx->gstore2), s + 1);
+            }
+        }
+
+        ++s;
+        d = next;
+    }
+
+    dfa_scanned(ctx, n, misses0);
+    return 0;
+}
+
+// a generation of the shared lazy DFA: an intern table that is only ever
+// inserted into. Once it holds limit states an empty generation replaces
+// it, twice as large unless RE_BOUND_MEM, and it is freed when no match
+// that may still hold one of its states is running.
+typedef struct DFAGen_ {
+    DState **table;    // slots, filled by CAS
+    int size;          // slots, power of 2
+    int limit;         // states before the generation is replaced
+    int count;         // states claimed so far
+    DState *dinit;
+    unsigned long retired; // epoch it was replaced in
+    struct DFAGen_ *next;  // link of retired generations
+} DFAGen;
+
+// announces the epoch a match started in, 0 while its context is idle
+typedef struct EpochSlot_ {
+    unsigned long epoch;
+    int busy;   // claimed by a context
+    struct EpochSlot_ *next;
+} EpochSlot;
+
+// lazy DFA shared by every context of an RE, see RE_SHARED_DFA. Readers
+// follow out[] with acquire loads and no locks; states are interned and
+// transitions published by CAS. A state only ever points to states of its
+// own or a newer generation, so a generation retired in epoch e is free
+// to go once every running match started after e.
+struct SharedDFA_ {
+    DFAGen *cur;
+    unsigned long epoch;  // starts at 1
+    EpochSlot *slots;     // never shrinks, idle slots are reused
+    DFAGen *retired;      // waiting for the matches that may hold them
+};
+
+static DFAGen *dfagen_new(int size)
+{
+    DFAGen *g = calloc(1, sizeof(DFAGen));
+    g->table = calloc(size, sizeof(DState*));
+    g->size = size;
+    g->limit = size / 2;
+    return g;
+}
+
+static void dfagen_free(DFAGen *g)
+{
+    for (int i = 0; i < g->size; ++i) {
+        free(g->table[i]);
+    }
+    free(g->table);
+    free(g);
+}
+
+static SharedDFA *shared_new(RE *re)
+{
+    SharedDFA *sh = calloc(1, sizeof(SharedDFA));
+    sh->cur = dfagen_new(RE_getoption(re, RE_BOUND_MEM) ? 2 * RE_CACHE_SIZE
+                         : RE_DTABLE_INIT);
+    sh->epoch = 1;
+    return sh;
+}
+
+static void shared_free(SharedDFA *sh)
+{
+    if (!sh) {
+        return;
+    }
+
+    while (sh->retired) {
+        DFAGen *g = sh->retired;
+        sh->retired = g->next;
+        dfagen_free(g);
+    }
+    while (sh->slots) {
+        EpochSlot *e = sh->slots;
+        sh->slots = e->next;
+        free(e);
+    }
+    dfagen_free(sh->cur);
+    free(sh);
+}
+
+static void push_retired(SharedDFA *sh, DFAGen *g)
+{
+    g->next = __atomic_load_n(&sh->retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sh->retired, &g->next, g, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+// free the retired generations no running match can reach. The list is
+// taken before the slots are read: a match missing from the scan then
+// started after the generations were replaced.
+static void shared_reclaim(SharedDFA *sh)
+{
+    DFAGen *g = __atomic_exchange_n(&sh->retired, NULL, __ATOMIC_SEQ_CST);
+    unsigned long oldest = ULONG_MAX;
+    for (EpochSlot *e = __atomic_load_n(&sh->slots, __ATOMIC_ACQUIRE); e; e = e->next) {
+        unsigned long epoch = __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (g) {
+        DFAGen *next = g->next;
+        if (g->retired < oldest) {
+            dfagen_free(g);
+        } else {
+            push_retired(sh, g);
+        }
+        g = next;
+    }
+}
+
+// replace the full generation g, unless another thread already did
+static void shared_replace(RE_ctx *ctx, SharedDFA *sh, DFAGen *g)
+{
+    RE *re = ctx->re;
+    int size = RE_getoption(re, RE_BOUND_MEM) ? g->size : 2 * g->size;
+    DFAGen *ng = dfagen_new(size);
+    DFAGen *expect = g;
+    if (!__atomic_compare_exchange_n(&sh->cur, &expect, ng, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        dfagen_free(ng);
+        return;
+    }
+
+    debug("shared DFA: generation of %d states replaced\n", g->limit);
+    ctx->st.flushes++;
+    g->retired = __atomic_fetch_add(&sh->epoch, 1, __ATOMIC_SEQ_CST);
+    push_retired(sh, g);
+    shared_reclaim(sh);
+}
+
+static void shared_enter(RE_ctx *ctx, SharedDFA *sh)
+{
+    EpochSlot *e = ctx->slot;
+    if (!e) {
+        for (e = __atomic_load_n(&sh->slots, __ATOMIC_ACQUIRE); e; e = e->next) {
+            int idle = 0;
+            if (__atomic_compare_exchange_n(&e->busy, &idle, 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        if (!e) {
+            e = calloc(1, sizeof(EpochSlot));
+            e->busy = 1;
+            e->next = __atomic_load_n(&sh->slots, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&sh->slots, &e->next, e, 0,
+                                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            }
+        }
+        ctx->slot = e;
+    }
+
+    __atomic_store_n(&e->epoch, __atomic_load_n(&sh->epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+static void shared_leave(RE_ctx *ctx, SharedDFA *sh)
+{
+    __atomic_store_n(&ctx->slot->epoch, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sh->retired, __ATOMIC_RELAXED)) {
+        shared_reclaim(sh);
+    }
+}
+
+// the state of sl in the current generation, added if missing. Must be
+// called while the listid stamps of sl are current; *gen is set to the
+// generation the state belongs to.
+static DState *shared_intern(RE_ctx *ctx, SharedDFA *sh, StateList *sl,
+                             DFAGen **gen)
+{
+    int nclass = ctx->re->priv->nclass;
+    uint64_t h = list_fingerprint(sl);
+    DState *d = NULL;
+
+    for (;;) {
+        DFAGen *g = __atomic_load_n(&sh->cur, __ATOMIC_ACQUIRE);
+        int mask = g->size - 1;
+        int i = h & mask;
+        DState *s;
+        *gen = g;
+        for (; (s = __atomic_load_n(&g->table[i], __ATOMIC_ACQUIRE)); i = (i + 1) & mask) {
+            if (dstate_equal(ctx, s, sl, h)) {
+                free(d);
+                return s;
+            }
+        }
+
+        if (__atomic_fetch_add(&g->count, 1, __ATOMIC_RELAXED) >= g->limit) {
+            shared_replace(ctx, sh, g);
+            continue;
+        }
+
+        if (!d) {
+            d = malloc(sizeof *d + sizeof d->out[0] * nclass
+                       + sizeof sl->ss[0] * sl->size);
+            d->sl.ss = (State **)(d->out + nclass);
+            d->nss = sl->size;
+            bzero(d->out, sizeof d->out[0] * nclass);
+            memcpy(d->sl.ss, sl->ss, sizeof sl->ss[0] * sl->size);
+            d->sl.size = sl->size;
+            d->matched = ismatched(sl);
+            d->lastscan = 0;
+            d->hash = h;
+            d->next = NULL;
+        }
+
+        // fewer than limit claims, so there is an empty slot ahead; a
+        // thread that got there first may have added the same state
+        for (;; i = (i + 1) & mask) {
+            DState *expect = NULL;
+            if (__atomic_compare_exchange_n(&g->table[i], &expect, d, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                ctx->st.dfa_states++;
+                return d;
+            }
+            if (dstate_equal(ctx, expect, sl, h)) {
+                free(d);
+                return expect;
+            }
+        }
+    }
+}
+
+static DState *shared_start(RE_ctx *ctx, SharedDFA *sh)
+{
+    DFAGen *g = __atomic_load_n(&sh->cur, __ATOMIC_ACQUIRE);
+    DState *d = __atomic_load_n(&g->dinit, __ATOMIC_ACQUIRE);
+    if (!d) {
+        d = shared_intern(ctx, sh, closure(ctx, ctx->re->start, &(ctx->gstore1)), &g);
+        DState *expect = NULL;
+        __atomic_compare_exchange_n(&g->dinit, &expect, d, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+    return d;
+}
+
+static DState *shared_dstep(RE_ctx *ctx, SharedDFA *sh, DState *d, int c)
+{
+    DFAGen *g;
+    step(ctx, &(d->sl), c, &(ctx->gstore1));
+    ctx->st.dfa_misses++;
+
+    // nothing of d is needed once its set is stepped. If a generation was
+    // replaced since the match announced its epoch, move the announcement
+    // up and leave d alone, or a long scan would pin every generation
+    // retired during it.
+    unsigned long epoch = __atomic_load_n(&sh->epoch, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->slot->epoch, __ATOMIC_RELAXED) != epoch) {
+        __atomic_store_n(&ctx->slot->epoch, epoch, __ATOMIC_SEQ_CST);
+        return shared_intern(ctx, sh, &(ctx->gstore1), &g);
+    }
+
+    DState *next = shared_intern(ctx, sh, &(ctx->gstore1), &g);
+    DState *expect = NULL;
+    DState **slot = &d->out[ctx->re->priv->classmap[c]];
+    if (!__atomic_compare_exchange_n(slot, &expect, next, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        next = expect;
+    }
+    return next;
+}
+
+// dmatch over the shared cache. Unanchored states always hold the start
+// closure, so a state of that size is the start state.
+static int shared_dmatch(RE_ctx *ctx, const char *s)
+{
+    RE *re = ctx->re;
+    SharedDFA *sh = re->priv->shared;
+    const unsigned char *classmap = re->priv->classmap;
+    const Prefilter *pf = use_prefilter(re) ? &re->priv->pf : NULL;
+    long credit = 0;
+    int matched = 0;
+    unsigned long n = 0, misses0 = ctx->st.dfa_misses;
+
+    shared_enter(ctx, sh);
+    DState *d = shared_start(ctx, sh);
+    if (d->matched) {
+        matched = 1;
+    }
+
+    while (*s && !matched) {
+        if (pf && d->sl.size == re->priv->nstart
+            && (s = dfa_prefilter_next(&pf, &credit, s)) == NULL) {
+            break;
+        }
+
+        int c = (unsigned char)*s;
+        DState *next = __atomic_load_n(&d->out[classmap[c]], __ATOMIC_ACQUIRE);
+        if (!next) {
+            next = shared_dstep(ctx, sh, d, c);
+        }
+
+        matched = next->matched;
+        ++n;
+        ++s;
+        d = next;
+    }
+
+    shared_leave(ctx, sh);
+    dfa_scanned(ctx, n, misses0);
+    return matched;
+}
+
+static int nfa_match(RE_ctx *ctx, const char *s)
+{
+    RE *re = ctx->re;
+    StateList *cl = closure(ctx, re->start, &(ctx->gstore1));
+    if (ismatched(cl)) {
+        return 1;
+    }
+    return nfa_run(ctx, cl, &(ctx->gstore2), s);
+}
+
+// simulate the NFA on s from the States of cl, nl is the other list
+static int nfa_run(RE_ctx *ctx, StateList *cl, StateList *nl, const char *s)
+{
+    RE *re = ctx->re;
+    REprivate *priv = re->priv;
+
+    const Prefilter *pf = use_prefilter(re) ? &priv->pf : NULL;
+    unsigned long steps0 = ctx->st.nfa_steps;
+    int matched = 0;
+    StateList *t;
+    while (*s && !matched) {
+        // unanchored lists always hold the start closure, so a list of that
+        // size is the start state
+        if (pf && cl->size == priv->nstart && (s = prefilter_next(pf, s)) == NULL) {
+            break;
+        }
+
+        step(ctx, cl, (unsigned char)*s++, nl);
+        t = nl, nl = cl, cl = t;
+        matched = ismatched(cl);
+    }
+
+    ctx->st.bytes += ctx->st.nfa_steps - steps0;
+    return matched;
+}
+
+// Glushkov position automaton of a pattern with at most RE_BITNFA_MAX
+// labelled States. Each labelled State is a position, numbered in pattern
+// order; the set of positions the last byte was consumed by is one
+// uint64_t D, and a step is
+//
+//   D' = (follow(D) | first) & label[c]
+//
+// Concatenation makes position i+1 follow i, those edges are a Shift-And
+// `(D & shift) << 1`. The rest of follow(D) comes from tables indexed a
+// byte of D at a time, only for the bytes holding positions with such
+// edges, and only while D has one. Nothing is allocated or cached.
+typedef struct BitNFA_ {
+    int empty;          // the empty string matches
+    uint64_t first;     // positions of the start closure
+    uint64_t last;      // positions followed by Match
+    uint64_t shift;     // positions i followed by i+1
+    uint64_t jump;      // positions followed by anything else
+    int nchunk;
+    int chunk[8];       // bytes of D that hold jump positions
+    uint64_t label[256];          // positions labelled with each byte
+    uint64_t follow[][256];       // jump edges of each chunk byte of D
+} BitNFA;
+
+// positions in the closure of s, set *matched if it holds Match
+static uint64_t position_set(RE *re, State *s, int *matched)
+{
+    StateList *sl = closure(re->priv->ctx, s, &(re->priv->ctx->gstore1));
+    uint64_t set = 0;
+    for (int i = 0; i < sl->size; ++i) {
+        if (sl->ss[i]->c == Match) {
+            *matched = 1;
+        } else {
+            set |= (uint64_t)1 << sl->ss[i]->id;
+        }
+    }
+    return set;
+}
+
+static int build_bitnfa(RE *re)
+{
+    REprivate *priv = re->priv;
+    State *pos[RE_BITNFA_MAX];
+    int n = 0;
+
+    // allocation order is pattern order
+    arena_foreach(&priv->states, State, s) {
+        if (s->c < 256) {
+            if (n == RE_BITNFA_MAX) {
+                return 0;
+            }
+            s->id = n;
+            pos[n++] = s;
+        }
+    }
+
+    uint64_t jumps[RE_BITNFA_MAX], last = 0, shift = 0, jump = 0;
+    for (int i = 0; i < n; ++i) {
+        uint64_t bit = (uint64_t)1 << i;
+        int matched = 0;
+        uint64_t follow = position_set(re, pos[i]->out, &matched);
+        if (matched) {
+            last |= bit;
+        }
+        if (follow & bit << 1) {
+            shift |= bit;
+            follow &= ~(bit << 1);
+        }
+        if (follow) {
+            jump |= bit;
+        }
+        jumps[i] = follow;
+    }
+
+    int nchunk = 0;
+    for (int j = 0; 8 * j < n; ++j) {
+        nchunk += ((jump >> 8 * j) & 0xff) != 0;
+    }
+
+    BitNFA *b = calloc(1, sizeof(BitNFA) + sizeof b->follow[0] * nchunk);
+    b->first = position_set(re, re->start, &b->empty);
+    b->last = last;
+    b->shift = shift;
+    b->jump = jump;
+    for (int i = 0; i < n; ++i) {
+        b->label[pos[i]->c] |= (uint64_t)1 << i;
+    }
+
+    // follow[k][v] is the union over the bits of v in byte chunk[k] of D,
+    // built from v minus its lowest bit
+    for (int j = 0; 8 * j < n; ++j) {
+        if (((b->jump >> 8 * j) & 0xff) == 0) {
+            continue;
+        }
+        int k = b->nchunk++;
+        b->chunk[k] = j;
+        for (int v = 1; v < 256; ++v) {
+            int i = 8 * j + __builtin_ctz(v);
+            b->follow[k][v] = b->follow[k][v & (v - 1)] | (i < n ? jumps[i] : 0);
+        }
+    }
+
+    debug("bit-parallel NFA: %d positions, %d jump bytes\n", n, b->nchunk);
+    priv->bnfa = b;
+    return 1;
+}
+
+static int bitnfa_match(RE_ctx *ctx, const char *s)
+{
+    RE *re = ctx->re;
+    const BitNFA *b = re->priv->bnfa;
+    const Prefilter *pf = use_prefilter(re) ? &re->priv->pf : NULL;
+    uint64_t init = RE_getoption(re, RE_ANCHOR_HEAD) ? 0 : b->first;
+    uint64_t reach = b->first; // positions the next byte may be consumed by
+    uint64_t d = 0;
+    unsigned long n = 0;
+    int matched = b->empty;
+
+    for (; *s && !matched; ++s) {
+        if (!d) {
+            if (!reach) { // anchored and dead
+                break;
+            }
+            if (pf && (s = prefilter_next(pf, s)) == NULL) {
+                break;
+            }
+        }
+
+        ++n;
+        d = reach & b->label[(unsigned char)*s];
+        if (d & b->last) {
+            matched = 1;
+            break;
+        }
+
+        reach = init | (d & b->shift) << 1;
+        if (d & b->jump) {
+            for (int k = 0; k < b->nchunk; ++k) {
+                reach |= b->follow[k][(d >> 8 * b->chunk[k]) & 0xff];
+            }
+        }
+    }
+
+    ctx->st.bitnfa++;
+    ctx->st.bytes += n;
+    return matched;
+}
+
+// Hopcroft's partition refinement over a complete DFA. States are kept in
+// elems, grouped by block; a block is elems[first[b], end[b]). Splitters are
+// whole blocks, each one refines every byte class, and when a block splits
+// only the smaller half has to be queued unless the block itself is queued.
+static int *hopcroft(int n, int k, const int *trans, const unsigned char *accept,
+                     int *nblocks)
+{
+    int *elems = malloc(sizeof(int) * n);
+    int *loc = malloc(sizeof(int) * n);
+    int *blk = malloc(sizeof(int) * n);
+    int *first = malloc(sizeof(int) * n);
+    int *end = malloc(sizeof(int) * n);
+    int *marked = calloc(n, sizeof(int));
+    int *touched = malloc(sizeof(int) * n);
+    int *queue = malloc(sizeof(int) * n);
+    char *queued = calloc(n, 1);
+    int *splitter = malloc(sizeof(int) * n);
+    int nb = 0, qn = 0;
+
+    // inverse transitions, bucketed by (class, target)
+    int *pstart = calloc(n * k + 1, sizeof(int));
+    int *preds = malloc(sizeof(int) * n * k);
+    for (int s = 0; s < n; ++s) {
+        for (int a = 0; a < k; ++a) {
+            pstart[a * n + trans[s * k + a] + 1]++;
+        }
+    }
+    for (int i = 0; i < n * k; ++i) {
+        pstart[i + 1] += pstart[i];
+    }
+    int *fill = malloc(sizeof(int) * n * k);
+    memcpy(fill, pstart, sizeof(int) * n * k);
+    for (int s = 0; s < n; ++s) {
+        for (int a = 0; a < k; ++a) {
+            preds[fill[a * n + trans[s * k + a]]++] = s;
+        }
+    }
+    free(fill);
+
+    // initial partition: accepting vs. rejecting states
+    int na = 0;
+    for (int s = 0; s < n; ++s) {
+        if (accept[s]) {
+            elems[na++] = s;
+        }
+    }
+    int nr = na;
+    for (int s = 0; s < n; ++s) {
+        if (!accept[s]) {
+            elems[nr++] = s;
+        }
+    }
+    if (na > 0) {
+        first[nb] = 0, end[nb] = na, nb++;
+    }
+    if (na < n) {
+        first[nb] = na, end[nb] = n, nb++;
+    }
+    for (int b = 0; b < nb; ++b) {
+        for (int i = first[b]; i < end[b]; ++i) {
+            loc[elems[i]] = i;
+            blk[elems[i]] = b;
+        }
+    }
+    int b0 = (nb == 2 && end[1] - first[1] < end[0] - first[0]) ? 1 : 0;
+    queue[qn++] = b0, queued[b0] = 1;
+
+    while (qn > 0) {
+        int sb = queue[--qn];
+        queued[sb] = 0;
+        int ns = end[sb] - first[sb];
+        memcpy(splitter, elems + first[sb], sizeof(int) * ns);
+
+        for (int a = 0; a < k; ++a) {
+            int nt = 0;
+            for (int i = 0; i < ns; ++i) {
+                int t = splitter[i];
+                for (int j = pstart[a * n + t]; j < pstart[a * n + t + 1]; ++j) {
+                    int x = preds[j], b = blk[x];
+                    if (loc[x] < first[b] + marked[b]) {
+                        continue;
+                    }
+                    if (marked[b] == 0) {
+                        touched[nt++] = b;
+                    }
+                    // swap x into the marked prefix of its block
+                    int y = elems[first[b] + marked[b]];
+                    elems[loc[x]] = y, loc[y] = loc[x];
+                    elems[first[b] + marked[b]] = x, loc[x] = first[b] + marked[b];
+                    marked[b]++;
+                }
+            }
+
+            for (int i = 0; i < nt; ++i) {
+                int b = touched[i], m = marked[b];
+                marked[b] = 0;
+                if (m == end[b] - first[b]) {
+                    continue;
+                }
+
+                int nbk = nb++;
+                first[nbk] = first[b], end[nbk] = first[b] + m;
+                first[b] += m;
+                for (int j = first[nbk]; j < end[nbk]; ++j) {
+                    blk[elems[j]] = nbk;
+                }
+
+                int small = (m <= end[b] - first[b]) ? nbk : b;
+                if (queued[b]) {
+                    small = nbk;
+                }
+                if (!queued[small]) {
+                    queue[qn++] = small, queued[small] = 1;
+                }
+            }
+        }
+    }
+
+    free(elems), free(loc), free(first), free(end), free(marked);
+    free(touched), free(queue), free(queued), free(splitter);
+    free(pstart), free(preds);
+    *nblocks = nb;
+    return blk;
+}
+
+static void free_full_dfa(RE *re)
+{
+    DFATable *f = re->priv->fdfa;
+    if (f) {
+        if (f->map) {
+            munmap(f->map, f->maplen);
+        } else {
+            free(f->trans);
+        }
+        free(f);
+        re->priv->fdfa = NULL;
+        re->priv->literals = 0;
+    }
+}
+
+static void release_dstates(RE_ctx *ctx);
+
+// complete subset construction over byte classes, then minimization.
+// DStates are built through the lazy cache and numbered by creation order,
+// which makes the cache itself the BFS queue. Returns 0 if the DFA needs
+// more than fdfa_limit states.
+static int build_full_dfa(RE *re)
+{
+    REprivate *priv = re->priv;
+    RE_ctx *ctx = priv->ctx;
+    int k = priv->nclass;
+    int classrep[256];
+    for (int c = 255; c >= 0; --c) {
+        classrep[priv->classmap[c]] = c;
+    }
+
+    free_dfa(ctx);
+    int cap = 64, n = 0;
+    DState **all = malloc(sizeof(DState*) * cap);
+    all[n++] = start_dstate(ctx, re->start);
+    all[0]->id = 0;
+
+    for (int i = 0; i < n; ++i) {
+        DState *d = all[i];
+        for (int a = 0; a < k; ++a) {
+            step(ctx, &(d->sl), classrep[a], &(ctx->gstore1));
+            int size = ctx->dstate_size;
+            DState *next = d->out[a] = dstate_from_list(ctx, &(ctx->gstore1));
+            if (ctx->dstate_size == size) {
+                continue;
+            }
+
+            if (n >= priv->fdfa_limit) {
+                free(all);
+                release_dstates(ctx);
+                return 0;
+            }
+            if (n == cap) {
+                cap *= 2;
+                all = realloc(all, sizeof(DState*) * cap);
+            }
+            next->id = n;
+            all[n++] = next;
+        }
+    }
+
+    // RE_match stops at the first accepting state, so accepting states may
+    // as well be absorbing; minimization then merges them all into one.
+    int *trans = malloc(sizeof(int) * n * k);
+    unsigned char *accept = malloc(n);
+    for (int i = 0; i < n; ++i) {
+        accept[i] = all[i]->matched;
+        for (int a = 0; a < k; ++a) {
+            trans[i * k + a] = accept[i] ? i : all[i]->out[a]->id;
+        }
+    }
+    free(all);
+    release_dstates(ctx);
+
+    int nb;
+    int *blk = hopcroft(n, k, trans, accept, &nb);
+
+    // renumber blocks, rejecting ones first
+    int *order = malloc(sizeof(int) * nb);
+    int nr = 0;
+    for (int b = 0; b < nb; ++b) {
+        order[b] = -1;
+    }
+    for (int want = 0; want < 2; ++want) {
+        for (int i = 0; i < n; ++i) {
+            if (accept[i] == want && order[blk[i]] < 0) {
+                order[blk[i]] = nr++;
+            }
+        }
+    }
+
+    DFATable *f = malloc(sizeof(DFATable));
+    f->nstates = nb;
+    f->nclass = k;
+    f->classmap = priv->classmap;
+    f->map = NULL;
+    f->start = order[blk[0]] * k;
+    f->accept_from = nb * k;
+    f->trans = malloc(sizeof(int) * nb * k);
+    for (int i = 0; i < n; ++i) {
+        int row = order[blk[i]] * k;
+        if (accept[i] && row < f->accept_from) {
+            f->accept_from = row;
+        }
+        for (int a = 0; a < k; ++a) {
+            f->trans[row + a] = order[blk[trans[i * k + a]]] * k;
+        }
+    }
+    free(order);
+    free(blk);
+    free(trans);
+    free(accept);
+
+    debug("full DFA: %d states, minimized to %d\n", n, nb);
+    priv->fdfa = f;
+    return 1;
+}
+
+// Aho-Corasick automaton for a pattern made of nothing but literals and
+// '|', as a whole or in one group. The trie's goto function is completed through the failure links
+// into a DFA over byte classes, so it needs no subset construction and
+// runs through full_dmatch. Nodes that end a literal, directly or by a
+// failure link, all become the single absorbing accepting state.
+static int build_ahocorasick(RE *re)
+{
+    REprivate *priv = re->priv;
+    const char *rep = priv->rep;
+    const char *end = rep + strlen(rep);
+    if (end - rep >= 2 && rep[0] == '(' && end[-1] == ')') {
+        rep++, end--; // any other paren is not a literal and fails below
+    }
+    int nalt = 1;
+    for (const char *p = rep; p < end; ++p) {
+        if (*p == '|') {
+            nalt++;
+        } else if (!isprim(*p)) {
+            return 0;
+        }
+    }
+    if (nalt < 2) {
+        return 0;
+    }
+
+    int k = priv->nclass;
+    int cap = end - rep + 1;
+    int *go = malloc(sizeof(int) * cap * k);
+    int *fail = malloc(sizeof(int) * cap);
+    char *term = calloc(cap, 1);
+    int n = 1;
+    for (int i = 0; i < cap * k; ++i) {
+        go[i] = -1;
+    }
+
+    // trie
+    for (const char *p = rep; p < end; ++p) {
+        int u = 0;
+        for (; p < end && *p != '|'; ++p) {
+            int a = priv->classmap[(unsigned char)*p];
+            if (go[u * k + a] < 0) {
+                go[u * k + a] = n++;
+            }
+            u = go[u * k + a];
+        }
+        term[u] = 1;
+        if (p == end) {
+            break;
+        }
+    }
+
+    // failure links in BFS order; an entry still -1 when its node is
+    // dequeued is no trie edge and takes the transition of the fail node
+    int *queue = malloc(sizeof(int) * n);
+    int qh = 0, qt = 0;
+    fail[0] = 0;
+    queue[qt++] = 0;
+    while (qh < qt) {
+        int u = queue[qh++];
+        for (int a = 0; a < k; ++a) {
+            int v = go[u * k + a];
+            int f = u ? go[fail[u] * k + a] : 0;
+            if (v < 0) {
+                go[u * k + a] = f;
+            } else {
+                fail[v] = f;
+                term[v] |= term[f];
+                queue[qt++] = v;
+            }
+        }
+    }
+
+    // renumber the nodes reachable without passing an accepting one,
+    // followed by one accepting state
+    int *id = malloc(sizeof(int) * n);
+    for (int u = 0; u < n; ++u) {
+        id[u] = -1;
+    }
+    int m = 0;
+    qh = qt = 0;
+    id[0] = m++;
+    queue[qt++] = 0;
+    while (qh < qt) {
+        int u = queue[qh++];
+        for (int a = 0; a < k; ++a) {
+            int v = go[u * k + a];
+            if (!term[v] && id[v] < 0) {
+                id[v] = m++;
+                queue[qt++] = v;
+            }
+        }
+    }
+
+    DFATable *f = malloc(sizeof(DFATable));
+    f->nstates = m + 1;
+    f->nclass = k;
+    f->classmap = priv->classmap;
+    f->map = NULL;
+    f->start = 0;
+    f->accept_from = m * k;
+    f->trans = malloc(sizeof(int) * (m + 1) * k);
+    for (int a = 0; a < k; ++a) {
+        f->trans[m * k + a] = m * k;
+    }
+    for (int i = 0; i < qt; ++i) {
+        int u = queue[i];
+        for (int a = 0; a < k; ++a) {
+            int v = go[u * k + a];
+            f->trans[id[u] * k + a] = term[v] ? m * k : id[v] * k;
+        }
+    }
+
+    free(id);
+    free(queue);
+    free(term);
+    free(fail);
+    free(go);
+
+    debug("Aho-Corasick: %d literals, %d states\n", nalt, m + 1);
+    priv->fdfa = f;
+    priv->literals = 1;
+    return 1;
+}
+
+void RE_dfa_info(RE *re, int *nstates, size_t *bytes)
+{
+    RE_ctx *ctx = re->priv->ctx;
+    if (nstates) {
+        *nstates = ctx ? ctx->dstate_size : 0;
+    }
+    if (bytes) {
+        *bytes = ctx ? ctx->dstate_bytes : 0;
+    }
+}
+
+int RE_full_dfa_info(RE *re, int *nstates, size_t *memsize)
+{
+    DFATable *f = re->priv->fdfa;
+    if (!f) {
+        return 0;
+    }
+
+    if (nstates) {
+        *nstates = f->nstates;
+    }
+    if (memsize) {
+        *memsize = sizeof *f + sizeof(int) * f->nstates * f->nclass;
+    }
+    return 1;
+}
+
+int RE_save(RE *re, const char *path)
+{
+    REprivate *priv = re->priv;
+    DFATable *f = priv->fdfa;
+    if (!f) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    DFAFile h;
+    bzero(&h, sizeof h);
+    strcpy(h.magic, DFA_MAGIC);
+    h.version = DFA_VERSION;
+    h.endian = DFA_ENDIAN;
+    h.options = priv->options;
+    h.nstates = f->nstates;
+    h.nclass = f->nclass;
+    h.start = f->start;
+    h.accept_from = f->accept_from;
+    h.rep_len = strlen(priv->rep);
+    h.classmap_off = sizeof h;
+    h.trans_off = h.classmap_off + 256;
+    h.rep_off = h.trans_off + sizeof(int32_t) * f->nstates * f->nclass;
+    h.size = h.rep_off + h.rep_len;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return -1;
+    }
+
+    fwrite(&h, sizeof h, 1, fp);
+    fwrite(f->classmap, 256, 1, fp);
+    fwrite(f->trans, sizeof(int32_t), f->nstates * f->nclass, fp);
+    fwrite(priv->rep, 1, h.rep_len, fp);
+    if (ferror(fp) | fclose(fp)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// the whole image is checked, a file that passes cannot make full_dmatch
+// read outside the mapping
+static int valid_dfafile(const DFAFile *h, size_t len)
+{
+    if (len < sizeof *h
+        || memcmp(h->magic, DFA_MAGIC, sizeof DFA_MAGIC) != 0
+        || h->version != DFA_VERSION
+        || h->endian != DFA_ENDIAN
+        || h->size != len
+        || h->nclass == 0 || h->nclass > 256
+        || h->nstates == 0) {
+        return 0;
+    }
+
+    // offsets are checked against what is left of the file, sums of
+    // them could wrap
+    uint64_t ntrans = (uint64_t)h->nstates * h->nclass;
+    if (h->classmap_off > len || len - h->classmap_off < 256
+        || h->trans_off % sizeof(int32_t) != 0 || h->trans_off > len
+        || (len - h->trans_off) / sizeof(int32_t) < ntrans
+        || h->rep_off > len || len - h->rep_off < h->rep_len
+        || h->start >= ntrans || h->start % h->nclass != 0
+        || h->accept_from > ntrans) {
+        return 0;
+    }
+
+    // full_dmatch indexes the table with these unchecked
+    const unsigned char *classmap = (const unsigned char *)h + h->classmap_off;
+    for (int c = 0; c < 256; ++c) {
+        if (classmap[c] >= h->nclass) {
+            return 0;
+        }
+    }
+    const int32_t *trans = (const int32_t *)((const char *)h + h->trans_off);
+    for (uint64_t i = 0; i < ntrans; ++i) {
+        if (trans[i] < 0 || trans[i] >= ntrans || trans[i] % h->nclass != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+RE *RE_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const DFAFile *h = map;
+    if (!valid_dfafile(h, st.st_size)) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    DFATable *f = malloc(sizeof(DFATable));
+    f->nstates = h->nstates;
+    f->nclass = h->nclass;
+    f->start = h->start;
+    f->accept_from = h->accept_from;
+    f->classmap = (const unsigned char *)map + h->classmap_off;
+    f->trans = (int *)((char *)map + h->trans_off);
+    f->map = map;
+    f->maplen = st.st_size;
+
+    // no NFA behind a loaded DFA, re->start stays NULL
+    RE *re = malloc(sizeof(RE));
+    re->start = NULL;
+    re->priv = malloc(sizeof(REprivate));
+    bzero(re->priv, sizeof(REprivate));
+    re->priv->rep = strndup((const char *)map + h->rep_off, h->rep_len);
+    re->priv->options = h->options | RE_FULL_DFA;
+    re->priv->fdfa = f;
+    return re;
+}
+
+static int full_dmatch(RE *re, RE_ctx *ctx, const char *s)
+{
+    const Prefilter *pf = use_prefilter(re) ? &re->priv->pf : NULL;
+    long credit = 0;
+    const DFATable *f = re->priv->fdfa;
+    const unsigned char *classmap = f->classmap;
+    const int *trans = f->trans;
+    size_t accept = f->accept_from;
+    size_t d = f->start;
+    unsigned long n = 0;
+
+    for (; *s && d < accept; ++s) {
+        if (pf && d == f->start
+            && (s = dfa_prefilter_next(&pf, &credit, s)) == NULL) {
+            break;
+        }
+
+        d = (unsigned)trans[d + classmap[(unsigned char)*s]];
+        ++n;
+    }
+
+    if (ctx) {
+        ctx->st.bytes += n;
+    }
+    return d >= accept;
+}
+
+// ctx is NULL for an RE loaded by RE_load, which only has the full DFA
+static int re_match(RE *re, RE_ctx *ctx, const char *s)
+{
+    if (ctx) {
+        ctx->st.searches++;
+    }
+    if (RE_getoption(re, RE_FULL_DFA)
+        || (re->priv->literals && !RE_getoption(re, RE_NO_AHOCORASICK))) {
+        return full_dmatch(re, ctx, s);
+    }
+
+    // a few instructions per byte and no cache: it replaces the NFA and the
+    // bounded DFA, only a lazy DFA free to grow walks faster once warm
+    if (re->priv->bnfa && !RE_getoption(re, RE_NO_BITPARALLEL)
+        && (!RE_getoption(re, RE_DFA) || RE_getoption(re, RE_BOUND_MEM))) {
+        return bitnfa_match(ctx, s);
+    }
+
+    if (RE_getoption(re, RE_DFA)) {
+        debug("run in DFA mode\n");
+        return re->priv->shared ? shared_dmatch(ctx, s) : dmatch(ctx, s);
+    }
+
+    return nfa_match(ctx, s);
+}
+
+int RE_match(RE *re, const char *s)
+{
+    return re_match(re, re->priv->ctx, s);
+}
+
+RE_ctx *RE_ctx_new(RE *re)
+{
+    RE_ctx *ctx = calloc(1, sizeof(RE_ctx));
+    ctx->re = re;
+    ctx->marks = calloc(re->priv->capacity, sizeof(int));
+    ctx->gstore1.ss = (State**)malloc(sizeof(State*) * re->priv->capacity);
+    ctx->gstore2.ss = (State**)malloc(sizeof(State*) * re->priv->capacity);
+    return ctx;
+}
+
+int RE_ctx_match(RE_ctx *ctx, const char *s)
+{
+    return re_match(ctx->re, ctx, s);
+}
+
+// to may be added to by other threads
+static void stats_add(REStats *to, const REStats *st)
+{
+#define stat_add(f) __atomic_fetch_add(&to->f, __atomic_load_n(&st->f, __ATOMIC_RELAXED), \
+                                       __ATOMIC_RELAXED)
+    stat_add(searches);
+    stat_add(bitnfa);
+    stat_add(bytes);
+    stat_add(nfa_steps);
+    stat_add(dfa_states);
+    stat_add(dfa_hits);
+    stat_add(dfa_misses);
+    stat_add(flushes);
+    stat_add(sweeps);
+    stat_add(restarts);
+    stat_add(jit_builds);
+    stat_add(jit_bytes);
+#undef stat_add
+
+    int peak = __atomic_load_n(&to->peak_list, __ATOMIC_RELAXED);
+    int add = __atomic_load_n(&st->peak_list, __ATOMIC_RELAXED);
+    while (add > peak
+           && !__atomic_compare_exchange_n(&to->peak_list, &peak, add, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void RE_ctx_free(RE_ctx *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+    if (ctx != ctx->re->priv->ctx) {
+        stats_add(&ctx->re->priv->retired, &ctx->st);
+    }
+
+    release_dstates(ctx); // free DFA caches
+    if (ctx->slot) {
+        __atomic_store_n(&ctx->slot->busy, 0, __ATOMIC_RELEASE);
+    }
+    free(ctx->gstore2.ss);
+    free(ctx->gstore1.ss);
+    free(ctx->marks);
+    free(ctx);
+}
+
+void RE_stats(RE *re, REStats *out)
+{
+    // the RE's own context is read unlocked, like RE_match writes it
+    bzero(out, sizeof *out);
+    stats_add(out, &re->priv->retired);
+    if (re->priv->ctx) {
+        stats_add(out, &re->priv->ctx->st);
+    }
+    out->compile_ms = re->priv->compile_ms;
+}
+
+void RE_ctx_stats(RE_ctx *ctx, REStats *out)
+{
+    *out = ctx->st;
+    out->compile_ms = ctx->re->priv->compile_ms;
+}
+
+RESet *RESet_compile(const char **pats, int n)
+{
+    if (n <= 0) {
+        err_quit(EBADRE);
+    }
+
+    double t = now_ms();
+    RESet *set = malloc(sizeof(RESet));
+    set->npats = n;
+    set->re = re_alloc(pats[0]);
+    set->re->start = compile_set(set->re, pats, 0, n);
+    re_finish(set->re);
+    RE_setoption(set->re, RE_DFA);
+    compile_done(set->re, t);
+    return set;
+}
+
+// set the bits of all patterns whose Match is in d, once per scan
+static int collect_matches(RE_ctx *ctx, DState *d, unsigned char *matched)
+{
+    int found = 0;
+    if (d->lastscan == ctx->scanid) {
+        return 0;
+    }
+
+    d->lastscan = ctx->scanid;
+    for (int i = 0; i < d->sl.size; ++i) {
+        State *s = d->sl.ss[i];
+        if (s->c == Match && !(matched[s->id / 8] & (1 << s->id % 8))) {
+            matched[s->id / 8] |= 1 << s->id % 8;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+// like dmatch, but the scan goes on past the first match until every
+// pattern has matched or the input ends
+int RESet_match(RESet *set, const char *s, unsigned char *matched)
+{
+    RE *re = set->re;
+    RE_ctx *ctx = re->priv->ctx;
+    const unsigned char *classmap = re->priv->classmap;
+    const Prefilter *pf = use_prefilter(re) ? &re->priv->pf : NULL;
+    long credit = 0;
+    int clock = dfa_budget(re) != 0;
+    int found = 0;
+    unsigned long n = 0, misses0 = ctx->st.dfa_misses;
+
+    bzero(matched, (set->npats + 7) / 8);
+    ctx->scanid++;
+    ctx->st.searches++;
+
+    DState *d = start_dstate(ctx, re->start);
+    DState *next;
+    if (d->matched) {
+        found += collect_matches(ctx, d, matched);
+    }
+
+    while (*s && found < set->npats) {
+        if (pf && d == ctx->dinit
+            && (s = dfa_prefilter_next(&pf, &credit, s)) == NULL) {
+            break;
+        }
+
+        int c = (unsigned char)*s;
+        if ((next = d->out[classmap[c]]) == NULL) {
+            next = dstep(ctx, d, c);
+        }
+        ++n;
+
+        if (next->matched) {
+            found += collect_matches(ctx, next, matched);
+        }
+        if (clock) {
+            next->used = 1;
+        }
+
+        ++s;
+        d = next;
+    }
+
+    dfa_scanned(ctx, n, misses0);
+    return found;
+}
+
+void RESet_free(RESet *set)
+{
+    RE_free(set->re);
+    free(set);
+}
+
+static void free_dfa(RE_ctx *ctx)
+{
+    jit_free(ctx);
+
+    for (int i = 0; i < ctx->dtable_size; ++i) {
+        DState *d = ctx->dtable[i];
+        if (d) {
+            d->next = ctx->dstates_free;
+            ctx->dstates_free = d;
+            ctx->dtable[i] = NULL;
+        }
+    }
+
+    if (ctx->dstate_size) {
+        ctx->st.flushes++;
+    }
+    ctx->dstate_size = 0;
+    ctx->dstate_bytes = 0;
+    ctx->dinit = NULL;
+}
+
+static void release_dstates(RE_ctx *ctx)
+{
+    debug("states before release: %d\n", ctx->dstate_size);
+
+    free_dfa(ctx);
+    while (ctx->dstates_free) {
+        DState *d = ctx->dstates_free;
+        ctx->dstates_free = d->next;
+        free(d);
+    }
+
+    free(ctx->dtable);
+    ctx->dtable = NULL;
+    ctx->dtable_size = 0;
+}
+
+void RE_free(RE *re)
+{
+    free(re->priv->rep);
+
+    clean_tempdata(re);
+    arena_free(&re->priv->states);
+
+    RE_ctx_free(re->priv->ctx);
+    shared_free(re->priv->shared);
+    free_full_dfa(re);
+    free(re->priv->bnfa);
+
+    free(re->priv);
+    free(re);
+}
+
+// heap held by a compiled RE before any match grows its DFA cache
+static size_t re_memsize(RE *re)
+{
+    REprivate *priv = re->priv;
+    size_t size = sizeof(RE) + sizeof(REprivate) + strlen(priv->rep) + 1;
+
+    for (ArenaBlock *b = priv->states.first; b; b = b->next) {
+        size += sizeof *b + b->size;
+    }
+    if (priv->ctx) {
+        size += sizeof(RE_ctx) + (sizeof(int) + 2 * sizeof(State*)) * priv->capacity;
+    }
+    if (priv->bnfa) {
+        size += sizeof(BitNFA) + sizeof priv->bnfa->follow[0] * priv->bnfa->nchunk;
+    }
+    size_t fsize;
+    if (RE_full_dfa_info(re, NULL, &fsize)) {
+        size += fsize;
+    }
+    return size;
+}
+
+typedef struct CacheEntry_ {
+    char *rep;
+    int opts;
+    uint64_t hash;
+    RE *re;
+    size_t size;   // re_memsize when compiled
+    int refs;      // callers holding re, plus one while cached
+    struct CacheEntry_ *hnext;       // hash chain
+    struct CacheEntry_ *prev, *next; // LRU list, most recent first
+} CacheEntry;
+
+struct RECache_ {
+    pthread_mutex_t lock;
+    CacheEntry **table; // chained hash table, power of 2 slots
+    int nslots;
+    CacheEntry *head, *tail;
+    size_t maxbytes;
+    RECacheStats stats;
+    int held;  // REs given out and not released yet
+    int freed; // by RECache_free, gone once nothing is held
+};
+
+RECache *RECache_new(size_t maxbytes)
+{
+    RECache *c = calloc(1, sizeof(RECache));
+    pthread_mutex_init(&c->lock, NULL);
+    c->nslots = RE_DTABLE_INIT;
+    c->table = calloc(c->nslots, sizeof(CacheEntry*));
+    c->maxbytes = maxbytes;
+    return c;
+}
+
+static uint64_t cache_hash(const char *rep, int opts)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (unsigned)opts; // FNV-1a
+    for (; *rep; ++rep) {
+        h = (h ^ (unsigned char)*rep) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static CacheEntry **cache_slot(RECache *c, uint64_t h)
+{
+    return &c->table[h & (c->nslots - 1)];
+}
+
+static void lru_unlink(RECache *c, CacheEntry *e)
+{
+    *(e->prev ? &e->prev->next : &c->head) = e->next;
+    *(e->next ? &e->next->prev : &c->tail) = e->prev;
+}
+
+static void lru_push(RECache *c, CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    *(c->head ? &c->head->prev : &c->tail) = e;
+    c->head = e;
+}
+
+static void entry_put(CacheEntry *e)
+{
+    if (--e->refs == 0) {
+        RE_free(e->re);
+        free(e->rep);
+        free(e);
+    }
+}
+
+static void cache_grow(RECache *c)
+{
+    CacheEntry **old = c->table;
+    int n = c->nslots;
+    c->nslots *= 2;
+    c->table = calloc(c->nslots, sizeof(CacheEntry*));
+    for (int i = 0; i < n; ++i) {
+        for (CacheEntry *e = old[i], *next; e; e = next) {
+            next = e->hnext;
+            CacheEntry **slot = cache_slot(c, e->hash);
+            e->hnext = *slot;
+            *slot = e;
+        }
+    }
+    free(old);
+}
+
+// drop least recently used entries until the cache fits its cap. Evicted
+// REs still held by callers are freed on their last RECache_release.
+static void cache_evict(RECache *c)
+{
+    while (c->stats.bytes > c->maxbytes && c->tail) {
+        CacheEntry *e = c->tail;
+        CacheEntry **pp = cache_slot(c, e->hash);
+        while (*pp != e) {
+            pp = &(*pp)->hnext;
+        }
+        *pp = e->hnext;
+        lru_unlink(c, e);
+
+        c->stats.bytes -= e->size;
+        c->stats.entries--;
+        c->stats.evictions++;
+        entry_put(e);
+    }
+}
+
+static CacheEntry *cache_find(RECache *c, const char *rep, int opts, uint64_t h)
+{
+    for (CacheEntry *e = *cache_slot(c, h); e; e = e->hnext) {
+        if (e->hash == h && e->opts == opts && strcmp(e->rep, rep) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// patterns are compiled outside the lock; if two threads miss on the same
+// key at once, the first one to insert wins and the other RE is dropped
+RE *RECache_get(RECache *c, const char *rep, int opts)
+{
+    uint64_t h = cache_hash(rep, opts);
+
+    pthread_mutex_lock(&c->lock);
+    CacheEntry *e = cache_find(c, rep, opts, h);
+    if (e) {
+        c->stats.hits++;
+        c->held++;
+        e->refs++;
+        lru_unlink(c, e);
+        lru_push(c, e);
+        pthread_mutex_unlock(&c->lock);
+        return e->re;
+    }
+    c->stats.misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    RE *re = RE_compile(rep);
+    if (opts) {
+        RE_setoption(re, opts);
+    }
+
+    CacheEntry *ne = calloc(1, sizeof(CacheEntry));
+    ne->rep = strdup(rep);
+    ne->opts = opts;
+    ne->hash = h;
+    ne->re = re;
+    ne->size = re_memsize(re);
+    ne->refs = 2;
+    re->priv->centry = ne;
+
+    pthread_mutex_lock(&c->lock);
+    c->held++;
+    if ((e = cache_find(c, rep, opts, h)) != NULL) {
+        e->refs++;
+        pthread_mutex_unlock(&c->lock);
+        ne->refs = 1;
+        entry_put(ne);
+        return e->re;
+    }
+
+    if (c->stats.entries >= c->nslots) {
+        cache_grow(c);
+    }
+    CacheEntry **slot = cache_slot(c, h);
+    ne->hnext = *slot;
+    *slot = ne;
+    lru_push(c, ne);
+    c->stats.bytes += ne->size;
+    c->stats.entries++;
+    cache_evict(c);
+    pthread_mutex_unlock(&c->lock);
+    return re;
+}
+
+static void cache_destroy(RECache *c)
+{
+    pthread_mutex_destroy(&c->lock);
+    free(c->table);
+    free(c);
+}
+
+void RECache_release(RECache *c, RE *re)
+{
+    pthread_mutex_lock(&c->lock);
+    entry_put(re->priv->centry);
+    int last = --c->held == 0 && c->freed;
+    pthread_mutex_unlock(&c->lock);
+    if (last) {
+        cache_destroy(c);
+    }
+}
+
+void RECache_stats(RECache *c, RECacheStats *out)
+{
+    pthread_mutex_lock(&c->lock);
+    *out = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
+
+// REs still held by callers stay valid until they are released, and the
+// cache itself until the last of them is
+void RECache_free(RECache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->maxbytes = 0;
+    cache_evict(c);
+    c->freed = 1;
+    int last = c->held == 0;
+    pthread_mutex_unlock(&c->lock);
+    if (last) {
+        cache_destroy(c);
+    }
+}
+
+#ifdef STANDALONE
+char *progname = NULL;
+
+static void print_stats(RE *re)
+{
+    REStats st;
+    RE_stats(re, &st);
+    fflush(stdout);
+    fprintf(stderr, "compile:    %.3f ms\n"
+            "searches:   %lu\n"
+            "bitnfa:     %lu\n"
+            "bytes:      %lu\n"
+            "nfa steps:  %lu\n"
+            "dfa states: %lu\n"
+            "dfa hits:   %lu\n"
+            "dfa misses: %lu\n"
+            "flushes:    %lu\n"
+            "sweeps:     %lu\n"
+            "restarts:   %lu\n"
+            "jit builds: %lu\n"
+            "jit bytes:  %lu\n"
+            "peak list:  %d\n", st.compile_ms, st.searches, st.bitnfa, st.bytes,
+            st.nfa_steps, st.dfa_states, st.dfa_hits, st.dfa_misses,
+            st.flushes, st.sweeps, st.restarts, st.jit_builds, st.jit_bytes,
+            st.peak_list);
+}
+
+int main(int argc, char *argv[])
+{
+    int stats = 0, opts = RE_DFA | RE_BOUND_MEM;
+    progname = basename(argv[0]);
+
+    for (; argc > 1; argv++, argc--) {
+        if (strcmp(argv[1], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[1], "--dfa") == 0) { // the lazy DFA, unbounded
+            opts = RE_DFA | RE_NO_BITPARALLEL;
+        } else if (strcmp(argv[1], "--nfa") == 0) { // Thompson simulation
+            opts = RE_NO_BITPARALLEL;
+        } else {
+            break;
+        }
+    }
+
+    if (argc == 4 && strcmp(argv[1], "-w") == 0) {
+        RE *re = RE_compile(argv[3]);
+        RE_setoption(re, RE_FULL_DFA);
+        if (RE_save(re, argv[2]) < 0) {
+            perror(argv[2]);
+            return 1;
+        }
+        RE_free(re);
+
+    } else if (argc == 4 && strcmp(argv[1], "-l") == 0) {
+        RE *re = RE_load(argv[2]);
+        if (!re) {
+            perror(argv[2]);
+            return 1;
+        }
+        printf("match: %s\n", RE_match(re, argv[3]) ? "yes" : "no");
+        if (stats) {
+            print_stats(re);
+        }
+        RE_free(re);
+
+    } else if (argc == 3) {
         RE *re = RE_compile(argv[1]);
-        RE_setoption(re, RE_DFA);
-        RE_setoption(re, RE_BOUND_MEM);
+        RE_setoption(re, opts);
 
         if (RE_getoption(re, RE_DUMP)) {
-            dump_nfa(re->start);
+            dump_nfa(re);
         }
 
         printf("match: %s\n", RE_match(re, argv[2]) ? "yes" : "no");
+        if (stats) {
+            print_stats(re);
+        }
 
         RE_free(re);
-        free(progname);
     } else {
-        fprintf(stderr, "%s re str", progname);
+        fprintf(stderr, "%s [--stats] [--dfa|--nfa] re str\n"
+                "%s -w dfafile re\n"
+                "%s [--stats] -l dfafile str\n", progname, progname, progname);
     }
     return 0;
 }
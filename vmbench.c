@@ -0,0 +1,307 @@
+// benchmarks for the revm Pike VM
+//
+// usage: vmbench [name]
+//   dispatch  threaded code against the switch, on capture heavy patterns
+//   captures  many threads alive, few of them saving captures
+//   onepass   the one-pass engine against the Pike VM, key=value lines
+//   backtrack the backtracker against the Pike VM, by input length
+//   allocs    heap allocations per warm re_exec, by engine, exits 1 on any
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "revm.h"
+#include "allocount.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// n strings of len random bytes of alphabet
+static char **random_strs(int n, int len, const char *alphabet, unsigned seed)
+{
+    int k = strlen(alphabet);
+    char **strs = malloc(sizeof(char *) * n);
+    srand(seed);
+    for (int i = 0; i < n; ++i) {
+        strs[i] = malloc(len + 1);
+        for (int j = 0; j < len; ++j) {
+            strs[i][j] = alphabet[rand() % k];
+        }
+        strs[i][len] = 0;
+    }
+    return strs;
+}
+
+static void free_strs(char **strs, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        free(strs[i]);
+    }
+    free(strs);
+}
+
+// MB/s of re_exec over strs, and how many matched
+static double mbs_exec(Re *re, char **strs, int n, int len, int *matched)
+{
+    double t = now();
+    *matched = 0;
+    for (int i = 0; i < n; ++i) {
+        *matched += re_exec(re, strs[i]);
+    }
+    return (double)n * len / (now() - t) / 1e6;
+}
+
+static const struct {
+    const char *name;
+    const char *rep;
+    const char *alphabet;
+} capture_cases[] = {
+    { "kv", "((a|b|c)+)=((0|1|2)+);((a|b|c)+)=((0|1|2)+)!", "abc012=;" },
+    { "nested", "((a|b)((a|b)(a|b)*)*)c", "ab" },
+    { "groups", "(a)(b)?(c)*(.)(a|b)(b|c)(c|a)(a)(b)d", "abc" },
+};
+
+// 1KB strings, none of them long enough a match to end the search early
+static void bench_dispatch(void)
+{
+    int n = 2000, len = 1024;
+
+    printf("%-8s %6s %12s %14s %8s\n", "case", "insts", "switch(MB/s)",
+           "threaded(MB/s)", "matched");
+    for (int i = 0; i < (int)(sizeof capture_cases / sizeof capture_cases[0]); ++i) {
+        char **strs = random_strs(n, len, capture_cases[i].alphabet, 7 + i);
+        Re *sw = re_new(capture_cases[i].rep, RE_PIKE | RE_SWITCH);
+        Re *th = re_new(capture_cases[i].rep, RE_PIKE);
+        int msw, mth;
+        mbs_exec(th, strs, n / 10, len, &mth); // warm up
+        double s = mbs_exec(sw, strs, n, len, &msw);
+        double t = mbs_exec(th, strs, n, len, &mth);
+        if (msw != mth) {
+            fprintf(stderr, "%s: switch matched %d, threaded %d\n",
+                    capture_cases[i].name, msw, mth);
+            exit(1);
+        }
+        printf("%-8s %6d %12.1f %14.1f %8d\n", capture_cases[i].name, th->size,
+               s, t, mth);
+        re_free(sw);
+        re_free(th);
+        free_strs(strs, n);
+    }
+}
+
+static const struct {
+    const char *name;
+    const char *rep;
+    const char *alphabet;
+} wide_cases[] = {
+    // a thread per .* still open, the captures set once at the start
+    { "stars", "(a)(.*b.*c.*a.*b.*c.*a.*b.*c)d", "abc" },
+    // a thread per position of the last 8 bytes
+    { "kgram", "(a)(?:a|b)*a(?:a|b)(?:a|b)(?:a|b)(?:a|b)(?:a|b)(?:a|b)(c)", "ab" },
+    // every thread saves at every byte
+    { "saves", "((a)|(b))*c", "ab" },
+};
+
+// threads share their captures until one saves, what the threads cost is
+// what they save
+static void bench_captures(void)
+{
+    int n = 2000, len = 1024;
+
+    printf("%-8s %6s %12s %14s %8s\n", "case", "insts", "switch(MB/s)",
+           "threaded(MB/s)", "matched");
+    for (int i = 0; i < (int)(sizeof wide_cases / sizeof wide_cases[0]); ++i) {
+        char **strs = random_strs(n, len, wide_cases[i].alphabet, 11 + i);
+        Re *sw = re_new(wide_cases[i].rep, RE_PIKE | RE_SWITCH);
+        Re *th = re_new(wide_cases[i].rep, RE_PIKE);
+        int msw, mth;
+        mbs_exec(th, strs, n / 10, len, &mth); // warm up
+        double s = mbs_exec(sw, strs, n, len, &msw);
+        double t = mbs_exec(th, strs, n, len, &mth);
+        printf("%-8s %6d %12.1f %14.1f %8d\n", wide_cases[i].name, th->size,
+               s, t, mth);
+        re_free(sw);
+        re_free(th);
+        free_strs(strs, n);
+    }
+}
+
+// n key=value;key=value... lines of len bytes, keys of abc, values of 012
+static char **kv_strs(int n, int len, unsigned seed)
+{
+    char **strs = malloc(sizeof(char *) * n);
+    srand(seed);
+    for (int i = 0; i < n; ++i) {
+        char *p = strs[i] = malloc(len + 1);
+        while (p - strs[i] < len - 4) {
+            int k = 1 + rand() % 8, v = 1 + rand() % 8;
+            if (p > strs[i]) {
+                *p++ = ';';
+            }
+            while (k-- && p - strs[i] < len - 3) {
+                *p++ = "abc"[rand() % 3];
+            }
+            *p++ = '=';
+            while (v-- && p - strs[i] < len) {
+                *p++ = "012"[rand() % 3];
+            }
+        }
+        *p = 0;
+    }
+    return strs;
+}
+
+static const struct {
+    const char *name;
+    const char *rep;
+} onepass_cases[] = {
+    { "kv", "^((a|b|c)+)=((0|1|2)+)(;(a|b|c)+=(0|1|2)+)*$" },
+    { "kv-last", "^((a|b|c)+=(0|1|2)+;)*((a|b|c)+)=((0|1|2)+)$" },
+    { "kv-first", "^((a|b|c)+)=((0|1|2)+)" },
+};
+
+// all of the lines match; kv-last is not one-pass, run as any other
+static void bench_onepass(void)
+{
+    static const int lens[] = { 32, 1024 };
+
+    printf("%-8s %6s %6s %10s %13s %8s\n", "case", "len", "insts", "pike(MB/s)",
+           "onepass(MB/s)", "matched");
+    for (int l = 0; l < (int)(sizeof lens / sizeof lens[0]); ++l) {
+        int len = lens[l], n = (1 << 21) / len;
+        char **strs = kv_strs(n, len, 13 + l);
+        for (int i = 0; i < (int)(sizeof onepass_cases / sizeof onepass_cases[0]); ++i) {
+            Re *pike = re_new(onepass_cases[i].rep, RE_PIKE);
+            Re *op = re_new(onepass_cases[i].rep, 0);
+            int mp, mo;
+            mbs_exec(op, strs, n / 10, len, &mo); // warm up
+            double p = mbs_exec(pike, strs, n, len, &mp);
+            double o = mbs_exec(op, strs, n, len, &mo);
+            if (mp != mo) {
+                fprintf(stderr, "%s: Pike VM matched %d, one-pass %d\n",
+                        onepass_cases[i].name, mp, mo);
+                exit(1);
+            }
+            printf("%-8s %6d %6d %10.1f %13.1f %8d%s\n", onepass_cases[i].name,
+                   len, op->size, p, o, mo, op->onepass ? "" : " (not one-pass)");
+            re_free(pike);
+            re_free(op);
+        }
+        free_strs(strs, n);
+    }
+}
+
+// short strings go to the backtracker, those past its bitmap budget to the
+// Pike VM again; kv-last on key=value lines, the rest on random ones
+static void bench_backtrack(void)
+{
+    static const int lens[] = { 16, 256, 2048, 16384 };
+    int ncases = sizeof capture_cases / sizeof capture_cases[0];
+
+    printf("%-8s %6s %6s %10s %15s %8s\n", "case", "len", "insts", "pike(MB/s)",
+           "backtrack(MB/s)", "matched");
+    for (int i = 0; i <= ncases; ++i) {
+        const char *name = i < ncases ? capture_cases[i].name : onepass_cases[1].name;
+        const char *rep = i < ncases ? capture_cases[i].rep : onepass_cases[1].rep;
+        Re *pike = re_new(rep, RE_PIKE);
+        Re *bt = re_new(rep, 0);
+        for (int l = 0; l < (int)(sizeof lens / sizeof lens[0]); ++l) {
+            int len = lens[l], n = (1 << 21) / len, mp, mb;
+            char **strs = i < ncases
+                ? random_strs(n, len, capture_cases[i].alphabet, 17 + l)
+                : kv_strs(n, len, 17 + l);
+            mbs_exec(bt, strs, n / 10, len, &mb); // warm up
+            double p = mbs_exec(pike, strs, n, len, &mp);
+            double b = mbs_exec(bt, strs, n, len, &mb);
+            if (mp != mb) {
+                fprintf(stderr, "%s: Pike VM matched %d, backtracker %d\n",
+                        name, mp, mb);
+                exit(1);
+            }
+            printf("%-8s %6d %6d %10.1f %15.1f %8d%s\n", name, len, bt->size,
+                   p, b, mb, (size_t)bt->size * (len + 1) > bt->backtrack_bits
+                   ? " (Pike VM)" : "");
+            free_strs(strs, n);
+        }
+        re_free(pike);
+        re_free(bt);
+    }
+}
+
+// after one warm-up call, an exec should not touch the heap whatever the
+// engine. Exits 1 if any allocates, for make test.
+static void bench_allocs(void)
+{
+    static const struct {
+        const char *name;
+        const char *rep;
+        int opts;
+    } cases[] = {
+        { "threaded", "((a|b)*)abb(a|b)", RE_PIKE },
+        { "switch", "((a|b)*)abb(a|b)", RE_PIKE | RE_SWITCH },
+        { "onepass", "^((a|c)+)b", 0 },
+        { "backtrack", "((a|b)*)abb(a|b)", 0 },
+    };
+    int runs = 1000, bad = 0;
+    char **strs = random_strs(1, 4096, "ac", 7);
+
+    printf("%-10s %12s %12s\n", "engine", "re_exec", "re_ctx_exec");
+    for (int i = 0; i < (int)(sizeof cases / sizeof cases[0]); ++i) {
+        Re *re = re_new(cases[i].rep, cases[i].opts);
+        ReCtx *ctx = re_ctx_new(re);
+        re_exec(re, strs[0]);
+        re_ctx_exec(ctx, strs[0]);
+
+        long n0 = alloc_count();
+        for (int j = 0; j < runs; ++j) {
+            re_exec(re, strs[0]);
+        }
+        long n1 = alloc_count();
+        for (int j = 0; j < runs; ++j) {
+            re_ctx_exec(ctx, strs[0]);
+        }
+        long n2 = alloc_count();
+
+        printf("%-10s %12.2f %12.2f\n", cases[i].name, (double)(n1 - n0) / runs,
+               (double)(n2 - n1) / runs);
+        bad += n2 != n0;
+        re_ctx_free(ctx);
+        re_free(re);
+    }
+
+    free_strs(strs, 1);
+    if (bad) {
+        fflush(stdout);
+        fprintf(stderr, "allocs: %d engines allocate in a warm exec\n", bad);
+        exit(1);
+    }
+}
+
+static struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    { "dispatch", bench_dispatch },
+    { "captures", bench_captures },
+    { "onepass", bench_onepass },
+    { "backtrack", bench_backtrack },
+    { "allocs", bench_allocs },
+};
+
+int main(int argc, char *argv[])
+{
+    int n = sizeof benches / sizeof benches[0];
+    for (int i = 0; i < n; ++i) {
+        if (argc < 2 || strcmp(argv[1], benches[i].name) == 0) {
+            printf("== %s\n", benches[i].name);
+            benches[i].fn();
+        }
+    }
+    return 0;
+}